@@ -0,0 +1,107 @@
+#ifndef SEEPHIT_CACHE_H
+#define SEEPHIT_CACHE_H
+
+#include "pch.h"
+
+namespace spt
+{
+
+// Bounded LRU of the rendered bodies of <cache> tags, see tree::use_cache
+// Lookups and inserts take a lock, a body is rendered outside it, so threads rendering at once may both render a miss
+// Entries are shared pointers, an entry evicted while a render writes it stays alive until the write is done
+class fragment_cache
+{
+  using clock = std::chrono::steady_clock;
+  using bytes = std::shared_ptr<const string>;
+
+  struct entry
+  {
+    string sKey;
+    bytes pBytes;
+
+    // When the entry goes stale, max() if it does not
+    clock::time_point tmExpires;
+  };
+
+  // Most recently used first
+  std::list<entry> m_lstEntries;
+  unordered_map<string, std::list<entry>::iterator> m_dctEntries;
+  size_t m_nMaxEntries;
+
+  std::mutex m_mtx;
+  std::atomic<size_t> m_nHits {0};
+  std::atomic<size_t> m_nMisses {0};
+
+public:
+  explicit fragment_cache(size_t nMaxEntries = 1024): m_nMaxEntries(nMaxEntries) {}
+
+  fragment_cache(const fragment_cache &) = delete;
+  fragment_cache &operator=(const fragment_cache &) = delete;
+
+  // Returns the bytes cached under a key, or null if there are none or they went stale
+  bytes find(const string &sKey)
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_dctEntries.find(sKey);
+    if(it == m_dctEntries.end() || it->second->tmExpires <= clock::now())
+    {
+      ++m_nMisses;
+      return nullptr;
+    }
+
+    ++m_nHits;
+    m_lstEntries.splice(m_lstEntries.begin(), m_lstEntries, it->second);
+    return it->second->pBytes;
+  }
+
+  // Caches bytes under a key for nTtl seconds, or until evicted if nTtl is 0, and returns them
+  bytes insert(const string &sKey, string sBytes, int nTtl)
+  {
+    bytes pBytes = std::make_shared<const string>(std::move(sBytes));
+    auto tmExpires = nTtl > 0 ? clock::now() + std::chrono::seconds(nTtl) : clock::time_point::max();
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if(!m_nMaxEntries) return pBytes;
+
+    auto it = m_dctEntries.find(sKey);
+    if(it != m_dctEntries.end())
+    {
+      it->second->pBytes = pBytes;
+      it->second->tmExpires = tmExpires;
+      m_lstEntries.splice(m_lstEntries.begin(), m_lstEntries, it->second);
+      return pBytes;
+    }
+
+    // Evict the least recently used
+    if(m_lstEntries.size() == m_nMaxEntries)
+    {
+      m_dctEntries.erase(m_lstEntries.back().sKey);
+      m_lstEntries.pop_back();
+    }
+
+    m_lstEntries.push_front(entry{sKey, pBytes, tmExpires});
+    m_dctEntries[sKey] = m_lstEntries.begin();
+    return pBytes;
+  }
+
+  // Drops every entry, the counters are kept
+  void clear()
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_dctEntries.clear();
+    m_lstEntries.clear();
+  }
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_lstEntries.size();
+  }
+
+  size_t hits() const   { return m_nHits; }
+  size_t misses() const { return m_nMisses; }
+};
+
+} // namespace spt
+
+#endif
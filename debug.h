@@ -10,9 +10,9 @@
 #define DUMP cerr
 #define ENDL "\n"
 
-// Dummy function to prettify compile-time errors
-#define PARSE_ERR(x) {cerr << "Parse Error:" << #x << endl;}
-#define PARSE_WARN(x) {cerr << "Parse Warning:" << #x << endl;}
+// Print errors and warnings as well as recording them, so runtime parses report them the same way
+#define PARSE_ERR(x) {cerr << "Parse Error:" << #x << endl; if(m_iErrRow == -1) {m_iErrRow = cur_row(); m_iErrCol = cur_col(); m_arrErrs = x;}}
+#define PARSE_WARN(x) {cerr << "Parse Warning:" << #x << endl; if(m_arrWarns.size() < SPT_MAX_WARNINGS) m_arrWarns.push_back(Message(x, cur_row(), cur_col()));}
 
 
 #else
@@ -42,8 +42,8 @@ constexpr ErrLine ParseError(const char* /*unused*/)
 // Set error message and location if not already set
 #define PARSE_ERR(x) if(m_iErrRow == -1) {m_iErrRow = cur_row(); m_iErrCol = cur_col(); m_arrErrs = x;}
 
-// Push warning message and location to list
-#define PARSE_WARN(x) m_arrWarns.push_back(Message(x, cur_row(), cur_col()))
+// Push warning message and location to list, warnings past the first SPT_MAX_WARNINGS are dropped
+#define PARSE_WARN(x) if(m_arrWarns.size() < SPT_MAX_WARNINGS) m_arrWarns.push_back(Message(x, cur_row(), cur_col()))
 
 
 #endif
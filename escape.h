@@ -0,0 +1,138 @@
+#ifndef SEEPHIT_ESCAPE_H
+#define SEEPHIT_ESCAPE_H
+
+#include "pch.h"
+#include "sink.h"
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace spt
+{
+
+// A value that is already valid markup, written as is instead of escaped
+struct raw_html
+{
+  string html;
+
+  bool operator==(const raw_html &other) const { return html == other.html; }
+  bool operator!=(const raw_html &other) const { return html != other.html; }
+};
+
+struct html_entity
+{
+  const char *psz;
+  size_t n;
+};
+
+// Returns the entity a character is escaped to in CTX, or one with a null psz if it is written as is
+template<html_ctx CTX> inline html_entity entity_of(char ch)
+{
+  switch(ch)
+  {
+    case '&':   return {"&amp;", 5};
+    case '<':   return {"&lt;", 4};
+    case '>':   return {"&gt;", 4};
+    case '"':   return CTX == HC_ATTR ? html_entity{"&quot;", 6} : html_entity{nullptr, 0};
+    case '\'':  return CTX == HC_ATTR ? html_entity{"&#39;", 5} : html_entity{nullptr, 0};
+    default:    return {nullptr, 0};
+  }
+}
+
+// Returns the first character in [p, pEnd) that needs escaping in CTX, or pEnd, one byte at a time
+template<html_ctx CTX> inline const char *find_special_scalar(const char *p, const char *pEnd)
+{
+  while(p != pEnd && !entity_of<CTX>(*p).psz) ++p;
+  return p;
+}
+
+// Same as find_special_scalar, but 32 or 16 bytes at a time where AVX2 or SSE2 is enabled
+// Clean runs are skipped with one compare per block, the tail is done by the scalar loop
+template<html_ctx CTX> inline const char *find_special(const char *p, const char *pEnd)
+{
+#if defined(__AVX2__)
+  const __m256i vAmp = _mm256_set1_epi8('&'), vLt = _mm256_set1_epi8('<'), vGt = _mm256_set1_epi8('>');
+  const __m256i vQuot = _mm256_set1_epi8('"'), vApos = _mm256_set1_epi8('\'');
+  for(; pEnd - p >= 32; p += 32)
+  {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i vHit = _mm256_or_si256(_mm256_cmpeq_epi8(v, vAmp), _mm256_or_si256(_mm256_cmpeq_epi8(v, vLt), _mm256_cmpeq_epi8(v, vGt)));
+    if(CTX == HC_ATTR)
+    {
+      vHit = _mm256_or_si256(vHit, _mm256_or_si256(_mm256_cmpeq_epi8(v, vQuot), _mm256_cmpeq_epi8(v, vApos)));
+    }
+
+    unsigned mask = _mm256_movemask_epi8(vHit);
+    if(mask) return p + __builtin_ctz(mask);
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i vAmp16 = _mm_set1_epi8('&'), vLt16 = _mm_set1_epi8('<'), vGt16 = _mm_set1_epi8('>');
+  const __m128i vQuot16 = _mm_set1_epi8('"'), vApos16 = _mm_set1_epi8('\'');
+  for(; pEnd - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i vHit = _mm_or_si128(_mm_cmpeq_epi8(v, vAmp16), _mm_or_si128(_mm_cmpeq_epi8(v, vLt16), _mm_cmpeq_epi8(v, vGt16)));
+    if(CTX == HC_ATTR)
+    {
+      vHit = _mm_or_si128(vHit, _mm_or_si128(_mm_cmpeq_epi8(v, vQuot16), _mm_cmpeq_epi8(v, vApos16)));
+    }
+
+    unsigned mask = _mm_movemask_epi8(vHit);
+    if(mask) return p + __builtin_ctz(mask);
+  }
+#endif
+
+  return find_special_scalar<CTX>(p, pEnd);
+}
+
+// Writes [p, p + n) escaped for CTX, runs of clean characters are written with a single copy
+// SIMD false scans one byte at a time, which is only there to compare against
+template<html_ctx CTX, bool SIMD = true> void write_escaped(sink &out, const char *p, size_t n)
+{
+  const char *pEnd = p + n;
+  while(true)
+  {
+    const char *pHit = SIMD ? find_special<CTX>(p, pEnd) : find_special_scalar<CTX>(p, pEnd);
+    out.write(p, pHit - p);
+    if(pHit == pEnd) break;
+
+    html_entity ent = entity_of<CTX>(*pHit);
+    out.write(ent.psz, ent.n);
+    p = pHit + 1;
+  }
+}
+
+inline void write_escaped(sink &out, const char *p, size_t n, html_ctx ctx)
+{
+  if(ctx == HC_ATTR)
+  {
+    write_escaped<HC_ATTR>(out, p, n);
+  }
+  else
+  {
+    write_escaped<HC_TEXT>(out, p, n);
+  }
+}
+
+// Size of [p, p + n) once escaped for CTX, found with the same scan write_escaped does
+template<html_ctx CTX> size_t escaped_size(const char *p, size_t n)
+{
+  const char *pEnd = p + n;
+  while((p = find_special<CTX>(p, pEnd)) != pEnd)
+  {
+    n += entity_of<CTX>(*p++).n - 1;
+  }
+  return n;
+}
+
+inline size_t escaped_size(const char *p, size_t n, html_ctx ctx)
+{
+  return ctx == HC_ATTR ? escaped_size<HC_ATTR>(p, n) : escaped_size<HC_TEXT>(p, n);
+}
+
+} // namespace spt
+
+#endif
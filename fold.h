@@ -0,0 +1,570 @@
+#ifndef SEEPHIT_FOLD_H
+#define SEEPHIT_FOLD_H
+
+#include "seephit.h"
+
+namespace spt
+{
+
+// Kinds of segments in a folded template
+enum seg_kind
+{
+  // Static markup, a range in the folded text
+  SEG_TEXT,
+
+  // {{key}} hole, rendered from a slot
+  SEG_KEY,
+
+  // {{$fn@param}} hole
+  SEG_FUN,
+
+  // Start of a <for> loop body, the body runs until the matching SEG_END
+  SEG_FOR,
+  SEG_END,
+
+  // <flush> tag, flushes the sink
+  SEG_FLUSH
+};
+
+struct segment
+{
+  seg_kind kind = SEG_TEXT;
+
+  // SEG_TEXT - range in the folded text
+  int iOffset = 0;
+  int iLen = 0;
+
+  // SEG_KEY - the key, SEG_FUN - the function param, SEG_FOR - the loop variable
+  char_view sym;
+
+  // SEG_KEY and SEG_FOR - slot of the key or loop variable, SEG_FUN - slot of the param
+  int iSlot = NULL_NODE;
+
+  // SEG_KEY - numeric format spec
+  value_format fmt;
+
+  // SEG_FUN - function id
+  int iFun = NULL_NODE;
+
+  // SEG_FOR - loop bounds and the index of the matching SEG_END
+  loop_params loop;
+  int iEnd = 0;
+};
+
+// Walks the compile time tree and emits the exact bytes tree::render would produce
+// Everything except template holes and loops is static, and goes to EMITTER::text()
+// <if> tags have constant conditions so they are resolved here
+template<typename EMITTER, typename PARSER, typename KEYS> class fold_walker
+{
+  const PARSER &m_parser;
+  const KEYS &m_keys;
+  EMITTER &m_emitter;
+
+  constexpr void text(const char_view &sym, bool bLower = false)
+  {
+    m_emitter.text(sym.begin(), sym.end(), bLower);
+  }
+
+  constexpr void text(const char *psz)
+  {
+    text(char_view(psz));
+  }
+
+  constexpr void indent(int indent)
+  {
+    for(int i = 0; i < indent; ++i) text("  ");
+  }
+
+  // Returns the value of an attribute of the node at index, or an empty symbol
+  // If an attribute is repeated the last value wins
+  constexpr char_view find_attr(int index, const char_view &symName) const
+  {
+    return m_parser.find_attr(index, symName);
+  }
+
+  // Renders attributes in source order, a repeated attribute keeps its first position
+  // {{key}} holes in values are escaped for an attribute
+  constexpr void attrs(int index)
+  {
+    m_parser.for_each_attr(index, [&](const char_view &symName, const char_view &symValue)
+    {
+      text(" ");
+      text(symName, true);
+      text("='");
+      parts(symValue, HC_ATTR);
+      text("'");
+    });
+  }
+
+  // Renders the parts of a text node, returns false if it has none
+  constexpr bool has_parts(const char_view &sym) const
+  {
+    bool bRet = false;
+    split_text(sym, [&](const char_view &, bool) { bRet = true; });
+    return bRet;
+  }
+
+  constexpr void parts(const char_view &sym, html_ctx ctx = HC_TEXT)
+  {
+    split_text(sym, [&](const char_view &part, bool bIsTemplate)
+    {
+      if(!bIsTemplate)
+      {
+        text(part);
+      }
+      else if(part.front() == '$')
+      {
+        char_view symName, symParam;
+        split_fun(part, symName, symParam);
+        m_emitter.fun(m_keys.fun_index(symName), symParam, m_keys.index(symParam));
+      }
+      else
+      {
+        char_view symName;
+        value_format fmt;
+        split_key(part, symName, fmt);
+        fmt.ctx = ctx;
+        m_emitter.key(symName, m_keys.index(symName), fmt);
+      }
+    });
+  }
+
+  // Returns the first child that is not the @attr node
+  constexpr int first_child(int index) const
+  {
+    int iChild = m_parser.m_arrNodes[index].child;
+    if(iChild > NULL_NODE && m_parser.m_arrNodes[iChild].iTag == TAG_ATTR)
+    {
+      iChild = m_parser.m_arrNodes[iChild].sibling;
+    }
+    return iChild;
+  }
+
+public:
+  constexpr fold_walker(const PARSER &parser, const KEYS &keys, EMITTER &emitter):
+    m_parser(parser), m_keys(keys), m_emitter(emitter) {}
+
+  // Renders a sibling chain
+  constexpr void nodes(int index, int indent)
+  {
+    for(; index > NULL_NODE; index = m_parser.m_arrNodes[index].sibling)
+    {
+      node(index, indent);
+    }
+  }
+
+  constexpr void node(int index, int iIndent)
+  {
+    const cnode &node = m_parser.m_arrNodes[index];
+    bool bVoidNode = node.child == VOID_TAG;
+    char_view symTag = m_parser.tag(node);
+    bool bTextNode = node.iTag == TAG_TEXT;
+    int iCtrl = m_parser.ctrl_tag(node);
+    bool bCtrlNode = iCtrl != TAG_NONE;
+    int iChild = bVoidNode ? NULL_NODE : first_child(index);
+
+    if(!bTextNode)
+    {
+      if(!bCtrlNode)
+      {
+        // Render the open tag, and the ID if any
+        indent(iIndent);
+        text("<");
+        text(symTag);
+        if(node.nId)
+        {
+          text(" ID='");
+          text(m_parser.id(node));
+          text("'");
+        }
+        attrs(index);
+        text(">");
+
+        // If tag has children add a newline and render them
+        if(iChild > NULL_NODE)
+        {
+          text("\n");
+          nodes(iChild, iIndent + 1);
+        }
+      }
+      else if(iCtrl == TAG_IF)
+      {
+        if(find_attr(index, "cond").toInt()) nodes(iChild, iIndent);
+      }
+      else if(iCtrl == TAG_FLUSH)
+      {
+        m_emitter.flush();
+      }
+      else if(iCtrl == TAG_FOR)
+      {
+        char_view symVar = find_attr(index, "var");
+        int iFor = m_emitter.loop(symVar, m_keys.index(symVar), m_parser.for_params(index));
+        nodes(iChild, iIndent);
+        m_emitter.end(iFor);
+      }
+      else
+      {
+        nodes(iChild, iIndent);
+      }
+    }
+
+    // Skip text and close tag for void tags and control tags
+    if(!bVoidNode)
+    {
+      char_view symText = m_parser.text(node);
+      if(has_parts(symText))
+      {
+        indent(iIndent);
+        parts(symText);
+        text("\n");
+      }
+
+      if(!bTextNode && !bCtrlNode)
+      {
+        indent(iIndent);
+        text("</");
+        text(symTag);
+        text(">\n");
+      }
+    }
+    else if(!bTextNode && iCtrl != TAG_FLUSH)
+    {
+      text("\n");
+    }
+  }
+};
+
+// Counts the text and segments a folded template needs
+// The key table holds NKEYS keys and NFUNS functions, SPT_FOLD sizes it from the text
+template<size_t NKEYS = SPT_MAX_KEYS, size_t NFUNS = NKEYS> struct fold_size
+{
+  size_t nChars = 0;
+  size_t nSegs = 0;
+  size_t nKeys = 0;
+  size_t nFuns = 0;
+  bool bInText = false;
+
+  template<typename PARSER> constexpr explicit fold_size(const PARSER &parser)
+  {
+    template_keys<NKEYS, NFUNS> keys(parser);
+    nKeys = keys.size();
+    nFuns = keys.m_arrFuns.size();
+
+    fold_walker<fold_size, PARSER, template_keys<NKEYS, NFUNS>> walker(parser, keys, *this);
+    if(parser.m_arrNodes.size()) walker.nodes(0, 0);
+  }
+
+  constexpr void text(const char *pBeg, const char *pEnd, bool /*unused*/)
+  {
+    nChars += pEnd - pBeg;
+    if(!bInText) ++nSegs;
+    bInText = true;
+  }
+
+  constexpr void key(const char_view &, int, const value_format &)    { ++nSegs; bInText = false; }
+  constexpr void fun(int, const char_view &, int)                   { ++nSegs; bInText = false; }
+  constexpr int loop(const char_view &, int, const loop_params &)   { bInText = false; return nSegs++; }
+  constexpr void end(int /*unused*/)                                { ++nSegs; bInText = false; }
+  constexpr void flush()                                            { ++nSegs; bInText = false; }
+};
+
+// A template folded at compile time into static text interleaved with holes and loops
+// A fully static template is a single segment, and renders as one write
+// Slot ids are the same as the runtime tree assigns, see slot_ids()
+// Declared at namespace scope with SPT_FOLD it is constant initialized, so nothing is built or allocated at startup
+template<size_t NCHARS, size_t NSEGS, size_t NKEYS, size_t NFUNS> class folded
+{
+  char m_szText[NCHARS + 1] {};
+  segment m_arrSegs[NSEGS + 1] {};
+  char_view m_arrKeys[NKEYS + 1] {};
+  
+  // Slot ids sorted by key name, see key_index
+  int m_arrSorted[NKEYS + 1] {};
+  char_view m_arrFuns[NFUNS + 1] {};
+  size_t m_nChars = 0;
+  size_t m_nSegs = 0;
+  uint64_t m_uHash = 0;
+
+  template<typename VALS> void render_range(sink &out, VALS &vals, const bound_funs &funs, size_t iBeg, size_t iEnd) const
+  {
+    for(size_t i = iBeg; i < iEnd; ++i)
+    {
+      const segment &seg = m_arrSegs[i];
+      switch(seg.kind)
+      {
+        case SEG_TEXT:
+          out.write_static(m_szText + seg.iOffset, seg.iLen);
+          break;
+
+        case SEG_KEY:
+          render_slot(out, vals, seg.iSlot, seg.sym, seg.fmt);
+          break;
+
+        case SEG_FUN:
+          funs.call(seg.iFun, out, fun_arg{std::string_view(seg.sym.begin(), seg.sym.size()), seg.iSlot}, loop_slots(vals));
+          break;
+
+        case SEG_FOR:
+          run_loop(loop_slots(vals), seg.iSlot, seg.loop, [&]
+          {
+            render_range(out, vals, funs, i + 1, seg.iEnd);
+          });
+          i = seg.iEnd;
+          break;
+
+        case SEG_END:
+          break;
+
+        case SEG_FLUSH:
+          out.flush();
+          break;
+      }
+    }
+  }
+
+  constexpr size_t static_size(size_t iBeg, size_t iEnd) const
+  {
+    size_t n = 0;
+    for(size_t i = iBeg; i < iEnd; ++i)
+    {
+      const segment &seg = m_arrSegs[i];
+      if(seg.kind == SEG_TEXT)
+      {
+        n += seg.iLen;
+      }
+      else if(seg.kind == SEG_FOR)
+      {
+        n += static_size(i + 1, seg.iEnd) * seg.loop.count();
+        i = seg.iEnd;
+      }
+    }
+    return n;
+  }
+
+public:
+  template<typename PARSER> constexpr explicit folded(const PARSER &parser): m_uHash(parser.m_uHash)
+  {
+    template_keys<NKEYS, NFUNS> keys(parser);
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+      m_arrKeys[i] = keys.m_arrKeys[i].name;
+      
+      // Insertion sort, templates have few keys
+      size_t j = i;
+      for(; j > 0 && m_arrKeys[i].cmpCase(m_arrKeys[m_arrSorted[j - 1]]) < 0; --j)
+      {
+        m_arrSorted[j] = m_arrSorted[j - 1];
+      }
+      m_arrSorted[j] = i;
+    }
+    for(size_t i = 0; i < keys.m_arrFuns.size(); ++i)
+    {
+      m_arrFuns[i] = keys.m_arrFuns[i];
+    }
+
+    fold_walker<folded, PARSER, template_keys<NKEYS, NFUNS>> walker(parser, keys, *this);
+    if(parser.m_arrNodes.size()) walker.nodes(0, 0);
+  }
+
+  // Emitter interface for fold_walker
+  constexpr void text(const char *pBeg, const char *pEnd, bool bLower)
+  {
+    if(!m_nSegs || m_arrSegs[m_nSegs - 1].kind != SEG_TEXT)
+    {
+      m_arrSegs[m_nSegs].kind = SEG_TEXT;
+      m_arrSegs[m_nSegs].iOffset = m_nChars;
+      ++m_nSegs;
+    }
+
+    for(auto p = pBeg; p != pEnd; ++p)
+    {
+      m_szText[m_nChars++] = bLower ? to_lower(*p) : *p;
+    }
+    m_arrSegs[m_nSegs - 1].iLen += pEnd - pBeg;
+  }
+
+  constexpr void key(const char_view &sym, int iSlot, const value_format &fmt)
+  {
+    m_arrSegs[m_nSegs].kind = SEG_KEY;
+    m_arrSegs[m_nSegs].sym = sym;
+    m_arrSegs[m_nSegs].iSlot = iSlot;
+    m_arrSegs[m_nSegs].fmt = fmt;
+    ++m_nSegs;
+  }
+
+  constexpr void fun(int iFun, const char_view &symParam, int iParamSlot)
+  {
+    m_arrSegs[m_nSegs].kind = SEG_FUN;
+    m_arrSegs[m_nSegs].iFun = iFun;
+    m_arrSegs[m_nSegs].sym = symParam;
+    m_arrSegs[m_nSegs].iSlot = iParamSlot;
+    ++m_nSegs;
+  }
+
+  constexpr int loop(const char_view &sym, int iSlot, const loop_params &loop)
+  {
+    segment &seg = m_arrSegs[m_nSegs];
+    seg.kind = SEG_FOR;
+    seg.sym = sym;
+    seg.iSlot = iSlot;
+    seg.loop = loop;
+    return m_nSegs++;
+  }
+
+  constexpr void end(int iFor)
+  {
+    m_arrSegs[m_nSegs].kind = SEG_END;
+    m_arrSegs[iFor].iEnd = m_nSegs;
+    ++m_nSegs;
+  }
+
+  constexpr void flush()
+  {
+    m_arrSegs[m_nSegs].kind = SEG_FLUSH;
+    ++m_nSegs;
+  }
+
+  constexpr size_t size() const               { return m_nSegs; }
+  constexpr const segment *begin() const      { return m_arrSegs; }
+  constexpr const segment *end() const        { return m_arrSegs + m_nSegs; }
+
+  // Whether the template has no holes or loops
+  constexpr bool is_static() const
+  {
+    return m_nSegs == 0 || (m_nSegs == 1 && m_arrSegs[0].kind == SEG_TEXT);
+  }
+
+  // Bytes of static markup a render writes, loop bodies counted once per iteration
+  // Keys and functions write on top of it, for a static template it is the exact output size
+  constexpr size_t static_size() const
+  {
+    return static_size(0, m_nSegs);
+  }
+
+  // Hash of the template text, a folded template has the same ETags as a tree, see tree::etag
+  constexpr uint64_t structure_hash() const
+  {
+    return m_uHash;
+  }
+
+  string etag(const template_slots &slots) const
+  {
+    return format_etag(hash_slots(slots, m_uHash));
+  }
+
+  string etag(const template_vals &dctVals) const
+  {
+    return etag(slots(dctVals));
+  }
+
+  // All the static markup, for a static template this is the whole output
+  constexpr char_view text() const
+  {
+    return char_view(m_szText, m_szText + m_nChars);
+  }
+
+  // Key names by slot id, and the lookup from names that slots() uses
+  constexpr key_index keys() const
+  {
+    return key_index{m_arrKeys, m_arrSorted, NKEYS};
+  }
+  
+  // Returns an empty value table for this template, names are looked up in keys() so no slot_dict is built
+  template_slots slots() const
+  {
+    return template_slots(keys());
+  }
+  
+  // Returns a value table filled from a dictionary of key names
+  template_slots slots(const template_vals &dctVals) const
+  {
+    template_slots ret(keys());
+    for(const auto &i: dctVals)
+    {
+      ret[i.first] = i.second;
+    }
+    return ret;
+  }
+  
+  // Returns the key name to slot id map, to build a template_slots table
+  slot_dict slot_ids() const
+  {
+    slot_dict ret;
+    for(size_t i = 0; i < NKEYS; ++i)
+    {
+      ret[string(m_arrKeys[i].begin(), m_arrKeys[i].end())] = i;
+    }
+    return ret;
+  }
+
+  // Looks up the functions the template calls, the result can be reused across renders
+  bound_funs bind(const template_funs &dctFuns) const
+  {
+    return bound_funs(dctFuns, m_arrFuns, m_arrFuns + NFUNS);
+  }
+
+  // Renders with a template_slots table or typed_vals
+  template<typename VALS> std::enable_if_t<is_slot_table<VALS>::value> render(sink &out, VALS &vals, const bound_funs &funs) const
+  {
+    render_range(out, vals, funs, 0, m_nSegs);
+  }
+
+  void render(sink &out, template_slots &slots, const template_funs &dctFuns) const
+  {
+    render_range(out, slots, bind(dctFuns), 0, m_nSegs);
+  }
+
+  // Renders without touching the caller's values, like tree::render
+  void render(sink &out, const template_slots &slots, const template_funs &dctFuns) const
+  {
+    template_slots ctx = template_slots::overlay(slots);
+    render_range(out, ctx, bind(dctFuns), 0, m_nSegs);
+  }
+  
+  void render(sink &out, const template_vals &dctVals, const template_funs &dctFuns) const
+  {
+    template_slots ctx = slots(dctVals);
+    render_range(out, ctx, bind(dctFuns), 0, m_nSegs);
+  }
+  
+#ifndef SPT_DEBUG
+  // Renders with values from a typed context, loop variables and function calls use a slot table for this render only
+  template<typename... FIELDS> void render(sink &out, const context<FIELDS...> &ctx, const template_funs &dctFuns) const
+  {
+    typed_vals<context<FIELDS...>> vals{ctx, slots()};
+    render_range(out, vals, bind(dctFuns), 0, m_nSegs);
+  }
+#endif
+  
+  // Renders a static template
+  void render(sink &out) const
+  {
+    assert(is_static());
+    out.write_static(m_szText, m_nChars);
+  }
+
+  // Renders into an ostream through an ostream_sink
+  template<typename VALS> void render(ostream &ostr, VALS &vals, const template_funs &dctFuns) const
+  {
+    ostream_sink out(ostr);
+    render(out, vals, dctFuns);
+  }
+
+  void render(ostream &ostr) const
+  {
+    assert(is_static());
+    ostr.write(m_szText, m_nChars);
+  }
+};
+
+} // namespace spt
+
+// Declares NAME as the constexpr folded form of a constexpr parser
+// The size of the folded text is computed by a first pass, which C++17 needs as a template argument
+// The key table of that pass is sized from the text like SPT_KEYS does, so there is no key limit
+#define SPT_FOLD(NAME, parser)                                                                        \
+constexpr spt::parse_capacity NAME##_capacity((parser).start());                                      \
+constexpr spt::fold_size<NAME##_capacity.nKeys, NAME##_capacity.nFuns> NAME##_size(parser);           \
+constexpr spt::folded<NAME##_size.nChars, NAME##_size.nSegs, NAME##_size.nKeys, NAME##_size.nFuns> NAME(parser)
+
+#endif
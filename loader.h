@@ -0,0 +1,172 @@
+#ifndef SEEPHIT_LOADER_H
+#define SEEPHIT_LOADER_H
+
+#include "seephit.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace spt
+{
+
+// Read only mapping of a file, followed by zeroed memory so the text ends with a 0 byte like a literal does
+// Zeroed pages are reserved first and the file is mapped over their start, so the text is parsed without being read into a buffer
+class mapped_file
+{
+  void *m_pMap = nullptr;
+  size_t m_nMap = 0;
+  size_t m_nSize = 0;
+
+public:
+  mapped_file() = default;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  mapped_file(mapped_file &&other) noexcept:
+    m_pMap(std::exchange(other.m_pMap, nullptr)), m_nMap(std::exchange(other.m_nMap, 0)), m_nSize(std::exchange(other.m_nSize, 0)) {}
+
+  mapped_file &operator=(mapped_file &&other) noexcept
+  {
+    std::swap(m_pMap, other.m_pMap);
+    std::swap(m_nMap, other.m_nMap);
+    std::swap(m_nSize, other.m_nSize);
+    return *this;
+  }
+
+  ~mapped_file()
+  {
+    if(m_pMap) munmap(m_pMap, m_nMap);
+  }
+
+  // Maps a file, returns 0 or the errno of the call that failed
+  int map(const char *pszPath)
+  {
+    int fd = ::open(pszPath, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return errno;
+
+    int nErr = 0;
+    struct stat st;
+    if(fstat(fd, &st) == 0)
+    {
+      // At least one byte past the text, a file that fills its last page gets another one
+      size_t nPage = sysconf(_SC_PAGESIZE);
+      size_t nSize = st.st_size;
+      size_t nMap = (nSize / nPage + 1) * nPage;
+
+      void *pMap = mmap(nullptr, nMap, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(pMap == MAP_FAILED)
+      {
+        nErr = errno;
+      }
+      else if(nSize && mmap(pMap, nSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+      {
+        nErr = errno;
+        munmap(pMap, nMap);
+      }
+      else
+      {
+        if(m_pMap) munmap(m_pMap, m_nMap);
+        m_pMap = pMap;
+        m_nMap = nMap;
+        m_nSize = nSize;
+      }
+    }
+    else
+    {
+      nErr = errno;
+    }
+
+    ::close(fd);
+    return nErr;
+  }
+
+  const char *data() const { return static_cast<const char *>(m_pMap); }
+  size_t size() const      { return m_nSize; }
+};
+
+// Whether a parse of the text fits in spt::parser
+// Checked before a runtime parse, since the fixed size tables are only bounds checked by the compiler
+// The tree keeps its keys in a slot_dict, which has no limit
+inline bool fits_parser(const char *pszText)
+{
+  parse_capacity cap(pszText);
+  return cap.nNodes <= SPT_MAX_NODES && cap.nIds <= SPT_MAX_IDS;
+}
+
+// A template parsed at runtime from a file, or why it could not be
+// Key names and function params in the tree are views into the text, which stays mapped for as long as the template lives
+class loaded_template
+{
+  mapped_file m_file;
+  std::unique_ptr<tree> m_pTree;
+  Message m_err;
+  vector<Message> m_arrWarns;
+  int m_nErrno = 0;
+  string m_sPath;
+
+  friend loaded_template load_template(const char *pszPath);
+
+public:
+  // Whether the file was read and parsed without errors
+  explicit operator bool() const { return m_pTree != nullptr; }
+
+  tree &get()             { return *m_pTree; }
+  const tree &get() const { return *m_pTree; }
+  tree *operator->()      { return m_pTree.get(); }
+
+  // The parse error and the warnings, with the same messages the compiler reports for literals
+  const Message &error() const              { return m_err; }
+  const vector<Message> &warnings() const   { return m_arrWarns; }
+
+  // The errno if the file could not be read, 0 otherwise
+  int sys_error() const { return m_nErrno; }
+
+  // Describes what went wrong as path:row:col: message, empty if nothing did
+  string error_text() const
+  {
+    if(m_nErrno) return m_sPath + ": " + std::strerror(m_nErrno);
+    if(m_err.m == Error_None) return string();
+    return m_sPath + ":" + std::to_string(m_err.row) + ":" + std::to_string(m_err.col) + ": " + g_arrMessageNames[m_err.m];
+  }
+};
+
+// Maps a template file and parses it with the same parser as _html, errors come back in the result
+// A 0 byte in the file is reported as Unexpected_end_of_stream where it is, and a template the parser has no room for as Template_too_large
+inline loaded_template load_template(const char *pszPath)
+{
+  loaded_template ret;
+  ret.m_sPath = pszPath;
+  ret.m_nErrno = ret.m_file.map(pszPath);
+  if(ret.m_nErrno) return ret;
+
+  const char *pszText = ret.m_file.data();
+  const char *pszEnd = pszText + ret.m_file.size();
+  if(auto p = static_cast<const char *>(memchr(pszText, 0, pszEnd - pszText)))
+  {
+    ret.m_err = Message(Error_Unexpected_end_of_stream, text_row(pszText, p), text_col(pszText, p));
+    return ret;
+  }
+
+  if(!fits_parser(pszText))
+  {
+    ret.m_err = Message(Error_Template_too_large, 1, 0);
+    return ret;
+  }
+
+  // The parser is too big for the stack, and is not needed once the tree is built
+  auto pParser = std::make_unique<parser>(pszText, pszEnd);
+  pParser->parse();
+  ret.m_arrWarns.assign(pParser->m_arrWarns.begin(), pParser->m_arrWarns.end());
+  if(pParser->m_iErrRow > -1)
+  {
+    ret.m_err = Message(pParser->m_arrErrs, pParser->m_iErrRow, pParser->m_iErrCol);
+    return ret;
+  }
+
+  ret.m_pTree = std::make_unique<tree>(*pParser);
+  return ret;
+}
+
+} // namespace spt
+
+#endif
@@ -13,24 +13,24 @@ int main()
   REPORT_ERRORS(parser);
     
   spt::tree spt_tree(parser);
-  spt::template_vals dct;
+  spt::template_slots dct = spt_tree.slots();
   spt::template_funs dctFuns;
   
   dct["s"] = "this should be quoted";
   
   dctFuns["double"] = 
-  [](ostream &ostr, const string &sKey, spt::template_vals &vals)
+  [](spt::sink &out, const spt::fun_arg &arg, spt::template_slots &vals)
   {
-    ostr << std::get<int>(vals[sKey]) * 2;
+    out << std::get<int>(arg.value(vals)) * 2;
   };
 
   dctFuns["quote"] = 
-  [](ostream &ostr, const string &sKey, spt::template_vals &vals)
+  [](spt::sink &out, const spt::fun_arg &arg, spt::template_slots &vals)
   {
-    ostr << '\'' << std::get<int>(vals[sKey]) << '\'';
+    out << '\'' << std::get<int>(arg.value(vals)) << '\'';
   };
   
-  spt_tree.root().render(cout, dct, dctFuns);
+  spt_tree.render(cout, dct, dctFuns);
   cout << endl;
   
   //parser.dump();
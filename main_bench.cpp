@@ -5,48 +5,278 @@
 using namespace std;
 
 
+// Runs fnRender into a string sink, prints the time taken and returns the output
+// With nReserve the sink starts with that many bytes, and a render that outgrows them is reported
+template<typename F> string bench(const char *pszName, F fnRender, size_t nReserve = 0)
+{
+  spt::string_sink out(nReserve ? nReserve : 256);
+
+  // Start timer and run it
+  auto tmStart = chrono::high_resolution_clock::now();
+  fnRender(out);
+
+  auto tmElapsed = chrono::high_resolution_clock::now() - tmStart;
+  long long nano = chrono::duration_cast<std::chrono::nanoseconds>(tmElapsed).count();
+  double ms = nano/1000000.0F;
+  cerr << pszName << ": " << ms << " ms elapsed" << endl;
+  if(nReserve && out.capacity() != nReserve)
+  {
+    cerr << pszName << ": output outgrew the " << nReserve << " bytes reserved" << endl;
+  }
+
+  return out.take();
+}
+
+// Template functions, registered as plain function pointers
+void fun_double(spt::sink &out, const spt::fun_arg &arg, spt::template_slots &vals)
+{
+  out << std::get<int>(arg.value(vals)) * 2;
+}
+
+void fun_quote(spt::sink &out, const spt::fun_arg &arg, spt::template_slots &vals)
+{
+  out << '\'' << std::get<int>(arg.value(vals)) << '\'';
+}
+
+// The most a call writes, loop_bench's params are below 500 so its estimate stays close to the output
+constexpr spt::fun_def g_arrFuns[] =
+{
+  {"double", &fun_double, 3},
+  {"quote", &fun_quote, 5}
+};
+
+constexpr auto parser =
+#include "test/loop_bench.spt"
+
+// Folded at compile time and constant initialized, nothing is built at startup
+// Folding relies on constexpr, which debug builds strip
+#ifndef SPT_DEBUG
+SPT_FOLD(g_folded, parser);
+#endif
+
+// A function param that names no key, its value is set by name and is still part of the ETag
+constexpr auto parserTag = R"*(<p>{{title}} {{$quote@count}}</p>)*"_html;
+
+#ifndef SPT_DEBUG
+SPT_FOLD(g_foldedTag, parserTag);
+#endif
+
+// Values from a typed context, rendered by every engine
+constexpr auto parserCtx =
+#include "test/template.spt"
+
+#ifndef SPT_DEBUG
+SPT_FOLD(g_foldedCtx, parserCtx);
+SPT_KEYS(g_keysCtx, parserCtx);
+using ctx_t = spt::context<SPT_FIELD(g_keysCtx, "name", string), SPT_FIELD(g_keysCtx, "profession", string), SPT_FIELD(g_keysCtx, "city", string)>;
+#endif
 
 int main()
 {
-  constexpr auto parser = 
-  #include "test/loop_bench.spt"
-    
   REPORT_ERRORS(parser);
-    
-  // Start timer and run it
-  auto tmStart = chrono::high_resolution_clock::now();
-  
-  int k;
-  for(int i = 0; i < 1; ++i)
+
+  spt::template_funs dctFuns(g_arrFuns);
+
+  int k = 0;
+
+  // Recursive walk over the rnode tree
+  string sTree = bench("rnode tree", [&](spt::sink &out)
   {
     spt::tree spt_tree(parser);
-    spt::template_vals dct;
-    spt::template_funs dctFuns;
-    
-    dctFuns["double"] = 
-    [](ostream &ostr, const string &sKey, spt::template_vals &vals)
+    spt::template_slots dct = spt_tree.slots();
+    spt_tree.render(out, dct, dctFuns);
+    k = dct.size();
+  });
+
+  // Same tree with the output reserved once from the size estimate
+  spt::tree treeSized(parser);
+  spt::template_slots dctSized = treeSized.slots();
+  size_t nEstimate = treeSized.estimate_size(dctSized, dctFuns);
+  string sSized = bench("rnode tree, output sized", [&](spt::sink &out)
+  {
+    treeSized.render(out, dctSized, dctFuns);
+  }, nEstimate);
+  cerr << "estimated " << nEstimate << " of " << sSized.size() << " bytes" << endl;
+
+  if(sSized != sTree)
+  {
+    cerr << "sized output differs from the rnode tree" << endl;
+  }
+
+  // Flat instruction stream
+  string sProgram = bench("program", [&](spt::sink &out)
+  {
+    spt::program prog(parser);
+    spt::template_slots dct = prog.slots();
+    prog.render(out, dct, dctFuns);
+  });
+
+#ifndef SPT_DEBUG
+  // Compile time fold, only the value table is created before rendering
+  string sFolded = bench("folded", [&](spt::sink &out)
+  {
+    spt::template_slots dct = g_folded.slots();
+    g_folded.render(out, dct, dctFuns);
+  });
+
+  if(sFolded != sTree)
+  {
+    cerr << "folded output differs from the rnode tree" << endl;
+  }
+#endif
+
+  // Same template loaded from a file at runtime, parsed and built into a tree
+  char szPath[] = "/tmp/spt_bench_XXXXXX";
+  int fd = mkstemp(szPath);
+  if(fd >= 0)
+  {
+    ssize_t nWritten = write(fd, parser.start(), strlen(parser.start()));
+    close(fd);
+
+    string sLoaded = bench("loaded template", [&](spt::sink &out)
     {
-      ostr << std::get<int>(vals[sKey]) * 2;
-    };
-    
-    dctFuns["quote"] = 
-    [](ostream &ostr, const string &sKey, spt::template_vals &vals)
+      spt::loaded_template tmpl = spt::load_template(szPath);
+      spt::template_slots dct = tmpl->slots();
+      tmpl->render(out, dct, dctFuns);
+    });
+    unlink(szPath);
+
+    if(nWritten < 0 || sLoaded != sTree)
     {
-      ostr << '\'' << std::get<int>(vals[sKey]) << '\'';
-    };
-    
-    
-    spt_tree.root().render(cout, dct, dctFuns);
-    k = dct.size();
+      cerr << "loaded template output differs from the rnode tree" << endl;
+    }
   }
-  
-  auto tmElapsed = chrono::high_resolution_clock::now() - tmStart;
-  long long nano = chrono::duration_cast<std::chrono::nanoseconds>(tmElapsed).count();
-  double ms = nano/1000000.0F;
-  cerr << ms << " ms elapsed" << endl;
+
+  // Same program into iovecs, static text is referenced rather than copied
+  spt::program prog(parser);
+  spt::template_slots dctProg = prog.slots();
+  spt::iovec_sink iov;
+  bench("program (iovec)", [&](spt::sink &)
+  {
+    prog.render(iov, dctProg, dctFuns);
+  });
+
+  // Time to the first 16K chunk of a streamed render, stays flat however big the loops are
+  bench("program cursor, first chunk", [&](spt::sink &out)
+  {
+    auto cur = prog.stream(dctProg, dctFuns);
+    if(cur.next()) out.write(cur.data(), cur.size());
+  });
+
+  // Loops split across threads, the functions above keep no state so they are thread safe
+  for(int nThreads: {1, 2, 4, 8})
+  {
+    spt::thread_pool pool(nThreads);
+    spt::parallel par(pool);
+    par.thread_safe("double").thread_safe("quote");
+
+    string sName = "rnode tree, " + to_string(nThreads) + " threads";
+    string sParallel = bench(sName.c_str(), [&](spt::sink &out)
+    {
+      spt::tree spt_tree(parser);
+      spt::template_slots dct = spt_tree.slots();
+      spt_tree.render(out, dct, dctFuns, par);
+    });
+
+    if(sParallel != sTree)
+    {
+      cerr << "parallel output differs from the rnode tree" << endl;
+    }
+  }
+
+  if(sProgram != sTree)
+  {
+    cerr << "program output differs from the rnode tree" << endl;
+  }
+
+  if(iov.str() != sTree)
+  {
+    cerr << "iovec output differs from the rnode tree" << endl;
+  }
+  cerr << iov.iov().size() << " iovecs" << endl;
+
+  // ETags agree between the engines, and change with the value of a param that names no key
+  spt::tree treeTag(parserTag);
+  spt::program progTag(parserTag);
+  spt::template_vals dctTag{{"title", string("Items")}, {"count", 1}};
+  string sTag = treeTag.etag(dctTag);
+  if(progTag.etag(dctTag) != sTag)
+  {
+    cerr << "program ETag differs from the rnode tree" << endl;
+  }
+#ifndef SPT_DEBUG
+  if(g_foldedTag.etag(dctTag) != sTag)
+  {
+    cerr << "folded ETag differs from the rnode tree" << endl;
+  }
+#endif
+
+  dctTag["count"] = 2;
+  if(treeTag.etag(dctTag) == sTag)
+  {
+    cerr << "ETag did not change with the value of a function param" << endl;
+  }
+
+#ifndef SPT_DEBUG
+  // A context that is not const renders through the typed overloads of every engine
+  ctx_t ctx;
+  ctx.get<SPT_KEY(g_keysCtx, "name")>() = "Mary";
+  ctx.get<SPT_KEY(g_keysCtx, "profession")>() = "engineer";
+  ctx.get<SPT_KEY(g_keysCtx, "city")>() = "London";
+
+  spt::tree treeCtx(parserCtx);
+  spt::program progCtx(parserCtx);
+  spt::string_sink outTree, outProg, outFolded;
+  treeCtx.render(outTree, ctx, dctFuns);
+  progCtx.render(outProg, ctx, dctFuns);
+  g_foldedCtx.render(outFolded, ctx, dctFuns);
+  if(outProg.str() != outTree.str() || outFolded.str() != outTree.str())
+  {
+    cerr << "typed context output differs between the engines" << endl;
+  }
+#endif
+
+  // Escaping throughput on text with a couple of special characters per line, and on clean text
+  // The sink is sized up front so only the escaping is timed
+  string sText;
+  while(sText.size() < (64 << 20))
+  {
+    sText += "Lorem ipsum dolor sit amet, consectetur adipiscing elit & sed do <eiusmod> tempor incididunt ut labore. ";
+  }
+  string sClean(sText.size(), 'x');
+  spt::string_sink escOut(sText.size() * 2);
+
+  auto escape_bench = [&](const char *pszName, const string &sIn, bool bSimd)
+  {
+    escOut.clear();
+    auto tmStart = chrono::high_resolution_clock::now();
+    if(bSimd)
+    {
+      spt::write_escaped<spt::HC_ATTR>(escOut, sIn.data(), sIn.size());
+    }
+    else
+    {
+      spt::write_escaped<spt::HC_ATTR, false>(escOut, sIn.data(), sIn.size());
+    }
+
+    auto tmElapsed = chrono::high_resolution_clock::now() - tmStart;
+    long long nano = chrono::duration_cast<std::chrono::nanoseconds>(tmElapsed).count();
+    cerr << pszName << ": " << double(sIn.size()) / nano << " GB/s" << endl;
+    return escOut.str();
+  };
+
+  string sSimd = escape_bench("escape", sText, true);
+  string sScalar = escape_bench("escape, byte at a time", sText, false);
+  escape_bench("escape, clean text", sClean, true);
+  escape_bench("escape, clean text, byte at a time", sClean, false);
+
+  if(sSimd != sScalar)
+  {
+    cerr << "escaped output differs from the byte at a time escape" << endl;
+  }
+
+  cout << sTree;
   cerr << k << " unique template keys" << endl;
-  
+
   cerr << endl;
 }
-
-
@@ -0,0 +1,204 @@
+#ifndef SEEPHIT_PARALLEL_H
+#define SEEPHIT_PARALLEL_H
+
+#include "pch.h"
+#include "util.h"
+
+namespace spt
+{
+
+// Fixed set of worker threads that run the tasks of a job, the calling thread helps too
+// Idle threads take the next task from the job, so uneven tasks still balance out
+// There are no per-thread deques to steal from: a job is one flat range of loop chunks, with about 4 per thread and of similar cost,
+// so one shared atomic counter balances them as well as work stealing would, with one atomic increment per chunk and no deque code
+class thread_pool
+{
+  struct job
+  {
+    const function<void(int)> *pFn;
+    int nTasks;
+    std::atomic<int> iNext {0};
+    int nDone = 0;
+  };
+
+  vector<std::thread> m_arrThreads;
+  std::mutex m_mtx;
+  std::condition_variable m_cvWork;
+  std::condition_variable m_cvDone;
+  std::shared_ptr<job> m_pJob;
+  unsigned m_nGen = 0;
+  bool m_bStop = false;
+
+  // Runs tasks of a job until none are left
+  void work(job &job)
+  {
+    int nDone = 0;
+    for(int i; (i = job.iNext++) < job.nTasks; ++nDone)
+    {
+      (*job.pFn)(i);
+    }
+
+    if(nDone)
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      job.nDone += nDone;
+      if(job.nDone == job.nTasks) m_cvDone.notify_all();
+    }
+  }
+
+  void worker()
+  {
+    unsigned nGen = 0;
+    while(true)
+    {
+      std::shared_ptr<job> pJob;
+      {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvWork.wait(lock, [&]{ return m_bStop || m_nGen != nGen; });
+        if(m_bStop) return;
+        nGen = m_nGen;
+        pJob = m_pJob;
+      }
+      work(*pJob);
+    }
+  }
+
+public:
+  // nThreads includes the calling thread
+  explicit thread_pool(int nThreads = std::thread::hardware_concurrency())
+  {
+    for(int i = 1; i < nThreads; ++i)
+    {
+      m_arrThreads.emplace_back([this]{ worker(); });
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  ~thread_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      m_bStop = true;
+    }
+    m_cvWork.notify_all();
+    for(auto &thread: m_arrThreads) thread.join();
+  }
+
+  int size() const { return m_arrThreads.size() + 1; }
+
+  // Calls fn(i) for i in [0, nTasks) and returns when all calls are done, fn must not throw
+  void run(int nTasks, const function<void(int)> &fn)
+  {
+    auto pJob = std::make_shared<job>();
+    pJob->pFn = &fn;
+    pJob->nTasks = nTasks;
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      m_pJob = pJob;
+      ++m_nGen;
+    }
+    m_cvWork.notify_all();
+
+    work(*pJob);
+
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cvDone.wait(lock, [&]{ return pJob->nDone == nTasks; });
+  }
+};
+
+// Opt-in settings for rendering big <for> loops on a thread pool
+// A loop is split only if it runs at least min_iters() times and every function called in its body
+// was declared thread safe, since each worker calls functions with its own overlay of the values
+class parallel
+{
+  thread_pool &m_pool;
+  std::unordered_set<string> m_setSafeFuns;
+  int m_nMinIters = 16;
+
+public:
+  explicit parallel(thread_pool &pool): m_pool(pool) {}
+
+  // Declares a template function safe to call from several threads at once
+  parallel &thread_safe(const string &sFun)
+  {
+    m_setSafeFuns.insert(sFun);
+    return *this;
+  }
+
+  parallel &min_iters(int n)
+  {
+    m_nMinIters = n;
+    return *this;
+  }
+
+  thread_pool &pool() const { return m_pool; }
+
+  // Whether a loop with nIters iterations that calls arrFuns should be split
+  bool split(int nIters, const vector<string> &arrFuns) const
+  {
+    if(m_pool.size() < 2 || nIters < m_nMinIters) return false;
+    for(const auto &sFun: arrFuns)
+    {
+      if(!m_setSafeFuns.count(sFun)) return false;
+    }
+    return true;
+  }
+};
+
+// Values for a render where loops may be split with par, see tree::render_for
+// Loop bodies rendered by workers get their own values, see chunk_vals, so nested loops inside them run sequentially
+template<typename VALS> struct parallel_vals
+{
+  VALS &vals;
+  const parallel &par;
+};
+
+template<typename VALS> void render_slot(sink &out, const parallel_vals<VALS> &vals, int iSlot, const char_view &symKey, const value_format &fmt)
+{
+  render_slot(out, vals.vals, iSlot, symKey, fmt);
+}
+
+template<typename VALS> template_slots &loop_slots(parallel_vals<VALS> &vals)
+{
+  return loop_slots(vals.vals);
+}
+
+// Returns the parallel settings of a render, if any
+template<typename VALS> const parallel *parallel_of(const VALS &)
+{
+  return nullptr;
+}
+
+template<typename VALS> const parallel *parallel_of(const parallel_vals<VALS> &vals)
+{
+  return &vals.par;
+}
+
+// Returns the values a chunk of a split loop renders with
+// A slot table is overlaid rather than copied, nothing writes to it while the chunks run
+template<typename VALS> VALS chunk_vals(const VALS &vals)
+{
+  return vals;
+}
+
+inline template_slots chunk_vals(const template_slots &slots)
+{
+  return template_slots::overlay(slots);
+}
+
+// Returns the values without the parallel settings
+template<typename VALS> VALS &inner_vals(VALS &vals)
+{
+  return vals;
+}
+
+template<typename VALS> VALS &inner_vals(parallel_vals<VALS> &vals)
+{
+  return vals.vals;
+}
+
+} // namespace spt
+
+#endif
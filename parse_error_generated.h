@@ -22,7 +22,11 @@ enum Messages
   Error_Unexpected_end_of_stream,
   Error_Invalid_syntax_in_for_tag,
   Error_Invalid_syntax_in_if_tag,
-  Error_Infinite_loop_in_for_tag
+  Error_Infinite_loop_in_for_tag,
+  Error_Unknown_template_key,
+  Error_Missing_value_for_template_key,
+  Error_Invalid_syntax_in_cache_tag,
+  Error_Template_too_large
 };
 
 struct None;
@@ -44,6 +48,10 @@ struct Unexpected_end_of_stream {};
 struct Invalid_syntax_in_for_tag {};
 struct Invalid_syntax_in_if_tag {};
 struct Infinite_loop_in_for_tag {};
+struct Unknown_template_key {};
+struct Missing_value_for_template_key {};
+struct Invalid_syntax_in_cache_tag {};
+struct Template_too_large {};
 
 template<Messages m> struct MsgToType{};
 
@@ -66,6 +74,38 @@ template<> struct MsgToType<Error_Unexpected_end_of_stream>{using type = Unexpec
 template<> struct MsgToType<Error_Invalid_syntax_in_for_tag>{using type = Invalid_syntax_in_for_tag;}; 
 template<> struct MsgToType<Error_Invalid_syntax_in_if_tag>{using type = Invalid_syntax_in_if_tag;}; 
 template<> struct MsgToType<Error_Infinite_loop_in_for_tag>{using type = Infinite_loop_in_for_tag;}; 
+template<> struct MsgToType<Error_Unknown_template_key>{using type = Unknown_template_key;}; 
+template<> struct MsgToType<Error_Missing_value_for_template_key>{using type = Missing_value_for_template_key;}; 
+template<> struct MsgToType<Error_Invalid_syntax_in_cache_tag>{using type = Invalid_syntax_in_cache_tag;}; 
+template<> struct MsgToType<Error_Template_too_large>{using type = Template_too_large;}; 
+
+// Message names by enum value, for errors reported at runtime
+constexpr const char *g_arrMessageNames[] =
+{
+  "None",
+  "Expecting_an_identifier",
+  "Unexpected_character_inside_tag_content",
+  "Expecting_a_tag_name_after_open_bracket",
+  "Empty_value_for_non_boolean_attribute",
+  "Duplicate_ID_on_tag",
+  "Expecting_a_value_for_attribute",
+  "Missing_open_bracket",
+  "Unknown_tag_name",
+  "Missing_close_bracket_on_void_tag",
+  "Missing_close_bracket_on_open_tag",
+  "Expecting_a_close_tag",
+  "Mismatched_Close_Tag",
+  "Missing_close_bracket_in_close_tag",
+  "Missing_close_brace_in_template",
+  "Unexpected_end_of_stream",
+  "Invalid_syntax_in_for_tag",
+  "Invalid_syntax_in_if_tag",
+  "Infinite_loop_in_for_tag",
+  "Unknown_template_key",
+  "Missing_value_for_template_key",
+  "Invalid_syntax_in_cache_tag",
+  "Template_too_large"
+};
 
 #ifndef SPT_DEBUG
 
@@ -91,6 +131,10 @@ if((x) < n)                                                      \
   spt::IF<w.m == spt::Error_Invalid_syntax_in_for_tag, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
   spt::IF<w.m == spt::Error_Invalid_syntax_in_if_tag, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
   spt::IF<w.m == spt::Error_Infinite_loop_in_for_tag, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
+  spt::IF<w.m == spt::Error_Unknown_template_key, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
+  spt::IF<w.m == spt::Error_Missing_value_for_template_key, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
+  spt::IF<w.m == spt::Error_Invalid_syntax_in_cache_tag, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
+  spt::IF<w.m == spt::Error_Template_too_large, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \
 }
 
 #define REPORT_ERRORS(parser)          \
@@ -2,14 +2,34 @@
 #define SEEPHIT_PCH_H
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <iostream>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 #include <functional>
 #include <variant>
+#include <tuple>
+#include <memory>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <charconv>
+#include <chrono>
+#include <list>
 
 using std::string;
 using std::vector;
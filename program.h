@@ -0,0 +1,394 @@
+#ifndef SEEPHIT_PROGRAM_H
+#define SEEPHIT_PROGRAM_H
+
+#include "seephit.h"
+
+namespace spt
+{
+
+// Linear render program, an alternative to walking the tree's nodes
+// The compile time tree is lowered once into a flat instruction stream which a single loop executes
+// <if> conditions are constant so they are resolved while lowering and need no jumps
+class program
+{
+public:
+  enum opcode : unsigned char
+  {
+    // Write b bytes of static text at offset a
+    OP_STATIC,
+
+    // Write slot a, b is the index of the key name and format
+    OP_SLOT,
+
+    // Call function a with argument b
+    OP_CALL,
+
+    // Start loop b with variable in slot a, jumps past the loop end if it runs zero times
+    OP_LOOP_BEGIN,
+
+    // Next iteration of the loop starting at instruction a
+    OP_LOOP_END,
+
+    // <flush> tag, flushes the sink or ends a chunk of a cursor
+    OP_FLUSH
+  };
+
+  struct instr
+  {
+    opcode op;
+    int a;
+    int b;
+  };
+
+private:
+  struct loop_info
+  {
+    loop_params params;
+
+    // Index of the OP_LOOP_END
+    int iEnd;
+  };
+
+  // State of a running loop
+  struct loop_frame
+  {
+    int pcBegin;
+    int i;
+    bool bUsed;
+    template_val varSaved;
+  };
+
+  string m_sStatic;
+  vector<instr> m_arrCode;
+  vector<loop_info> m_arrLoops;
+
+  // Key names for error messages and their formats, function names by id and call arguments
+  vector<char_view> m_arrKeys;
+  vector<value_format> m_arrFormats;
+  vector<char_view> m_arrFunNames;
+  vector<fun_arg> m_arrArgs;
+
+  slot_dict m_dctSlots;
+  uint64_t m_uHash = 0;
+  int m_nDepth = 0;
+  int m_nMaxDepth = 0;
+
+  // Where a run of the program is, so a cursor can stop and resume it
+  struct exec_state
+  {
+    int pc = 0;
+    vector<loop_frame> arrFrames;
+  };
+
+public:
+  // Lowers the parsed template, throws if it has more than SPT_MAX_KEYS keys or functions
+  template<typename PARSER> explicit program(const PARSER &parser): m_uHash(parser.m_uHash)
+  {
+    template_keys<> keys(parser);
+    if(keys.too_large())
+    {
+      cerr << endl << "Template too large, more than " << SPT_MAX_KEYS << " keys or functions: '" << keys.m_symOverflow << "'" << endl;
+      throw false;
+    }
+    
+    for(size_t i = 0; i < keys.size(); ++i)
+    {
+      const char_view &sym = keys.m_arrKeys[i].name;
+      m_dctSlots[string(sym.begin(), sym.end())] = i;
+    }
+    m_arrFunNames.assign(keys.m_arrFuns.begin(), keys.m_arrFuns.end());
+
+    fold_walker<program, PARSER, template_keys<>> walker(parser, keys, *this);
+    if(parser.m_arrNodes.size()) walker.nodes(0, 0);
+  }
+
+  // Emitter interface for fold_walker
+  void text(const char *pBeg, const char *pEnd, bool bLower)
+  {
+    // Extend the previous static text if possible
+    if(m_arrCode.empty() || m_arrCode.back().op != OP_STATIC)
+    {
+      m_arrCode.push_back(instr{OP_STATIC, int(m_sStatic.size()), 0});
+    }
+
+    for(auto p = pBeg; p != pEnd; ++p)
+    {
+      m_sStatic += bLower ? to_lower(*p) : *p;
+    }
+    m_arrCode.back().b += pEnd - pBeg;
+  }
+
+  void key(const char_view &sym, int iSlot, const value_format &fmt)
+  {
+    m_arrKeys.push_back(sym);
+    m_arrFormats.push_back(fmt);
+    m_arrCode.push_back(instr{OP_SLOT, iSlot, int(m_arrKeys.size() - 1)});
+  }
+
+  void fun(int iFun, const char_view &symParam, int iParamSlot)
+  {
+    m_arrArgs.push_back(fun_arg{std::string_view(symParam.begin(), symParam.size()), iParamSlot});
+    m_arrCode.push_back(instr{OP_CALL, iFun, int(m_arrArgs.size() - 1)});
+  }
+
+  int loop(const char_view & /*unused*/, int iSlot, const loop_params &params)
+  {
+    m_arrLoops.push_back(loop_info{params, 0});
+    m_arrCode.push_back(instr{OP_LOOP_BEGIN, iSlot, int(m_arrLoops.size() - 1)});
+    m_nMaxDepth = std::max(m_nMaxDepth, ++m_nDepth);
+    return m_arrCode.size() - 1;
+  }
+
+  void end(int iFor)
+  {
+    m_arrLoops[m_arrCode[iFor].b].iEnd = m_arrCode.size();
+    m_arrCode.push_back(instr{OP_LOOP_END, iFor, 0});
+    --m_nDepth;
+  }
+
+  void flush()
+  {
+    m_arrCode.push_back(instr{OP_FLUSH, 0, 0});
+  }
+
+  const vector<instr> &code() const { return m_arrCode; }
+
+  // Returns an empty value table, slot ids are the same as the runtime tree assigns
+  template_slots slots() const
+  {
+    return template_slots(m_dctSlots);
+  }
+
+  // Returns a value table filled from a dictionary of key names
+  template_slots slots(const template_vals &dctVals) const
+  {
+    template_slots ret(m_dctSlots);
+    for(const auto &i: dctVals)
+    {
+      ret[i.first] = i.second;
+    }
+    return ret;
+  }
+
+  const slot_dict &slot_ids() const
+  {
+    return m_dctSlots;
+  }
+
+  // Hash of the template text and ETags, the same as the tree's, see tree::etag
+  uint64_t structure_hash() const
+  {
+    return m_uHash;
+  }
+
+  string etag(const template_slots &slots) const
+  {
+    return format_etag(hash_slots(slots, m_uHash));
+  }
+
+  string etag(const template_vals &dctVals) const
+  {
+    return etag(slots(dctVals));
+  }
+
+private:
+  // Runs instructions from st.pc until the end, returns false when done
+  // With a pChunk it stops after a <flush> or once pChunk holds nChunk bytes, and returns true
+  template<typename VALS> bool exec(exec_state &st, sink &out, VALS &vals, const bound_funs &funs,
+    const string_sink *pChunk = nullptr, size_t nChunk = 0) const
+  {
+    template_slots &slots = loop_slots(vals);
+    vector<loop_frame> &arrFrames = st.arrFrames;
+
+    const instr *pCode = m_arrCode.data();
+    const char *pStatic = m_sStatic.data();
+    int nCode = m_arrCode.size();
+
+    for(int pc = st.pc; pc < nCode; ++pc)
+    {
+      const instr &in = pCode[pc];
+      switch(in.op)
+      {
+        case OP_STATIC:
+          out.write_static(pStatic + in.a, in.b);
+          break;
+        case OP_SLOT:
+          render_slot(out, vals, in.a, m_arrKeys[in.b], m_arrFormats[in.b]);
+          break;
+
+        case OP_CALL:
+          funs.call(in.a, out, m_arrArgs[in.b], slots);
+          break;
+
+        case OP_LOOP_BEGIN:
+        {
+          const loop_params &loop = m_arrLoops[in.b].params;
+          if(loop.iInc > 0 ? loop.iFrom >= loop.iTo : loop.iFrom <= loop.iTo)
+          {
+            pc = m_arrLoops[in.b].iEnd;
+            break;
+          }
+
+          // Save the existing variable if any, like run_loop
+          arrFrames.push_back(loop_frame{pc, loop.iFrom, slots.bound(in.a), {}});
+          if(arrFrames.back().bUsed) arrFrames.back().varSaved = slots.at(in.a);
+          slots.set_int(in.a, loop.iFrom);
+          break;
+        }
+
+        case OP_LOOP_END:
+        {
+          loop_frame &frame = arrFrames.back();
+          const instr &inBegin = pCode[frame.pcBegin];
+          const loop_params &loop = m_arrLoops[inBegin.b].params;
+
+          frame.i += loop.iInc;
+          if(loop.iInc > 0 ? frame.i < loop.iTo : frame.i > loop.iTo)
+          {
+            slots.set_int(inBegin.a, frame.i);
+            pc = frame.pcBegin;
+          }
+          else
+          {
+            // Restore the loop var or unbind it if it wasnt bound before
+            if(frame.bUsed)
+            {
+              slots[inBegin.a] = std::move(frame.varSaved);
+            }
+            else
+            {
+              slots.unbind(inBegin.a);
+            }
+            arrFrames.pop_back();
+          }
+          break;
+        }
+
+        case OP_FLUSH:
+          if(pChunk)
+          {
+            st.pc = pc + 1;
+            return true;
+          }
+          out.flush();
+          break;
+      }
+
+      if(pChunk && pChunk->size() >= nChunk)
+      {
+        st.pc = pc + 1;
+        return true;
+      }
+    }
+
+    st.pc = nCode;
+    return false;
+  }
+
+public:
+  // Looks up the functions the program calls, the result can be reused across renders
+  bound_funs bind(const template_funs &dctFuns) const
+  {
+    return bound_funs(dctFuns, m_arrFunNames.begin(), m_arrFunNames.end());
+  }
+
+  // Runs the program with a template_slots table or typed_vals
+  // Anything else, such as a context that is not const, goes to the overloads below that build one
+  template<typename VALS> std::enable_if_t<is_slot_table<VALS>::value> render(sink &out, VALS &vals, const bound_funs &funs) const
+  {
+    exec_state st;
+    st.arrFrames.reserve(m_nMaxDepth);
+    exec(st, out, vals, funs);
+  }
+
+  template<typename VALS> std::enable_if_t<is_slot_table<VALS>::value> render(sink &out, VALS &vals, const template_funs &dctFuns) const
+  {
+    render(out, vals, bind(dctFuns));
+  }
+
+  // Renders without touching the caller's values, like tree::render
+  void render(sink &out, const template_slots &slots, const template_funs &dctFuns) const
+  {
+    template_slots ctx = template_slots::overlay(slots);
+    render(out, ctx, dctFuns);
+  }
+
+  void render(sink &out, const template_vals &dctVals, const template_funs &dctFuns) const
+  {
+    template_slots ctx = slots(dctVals);
+    render(out, ctx, dctFuns);
+  }
+
+  // Renders into an ostream through an ostream_sink
+  template<typename VALS> void render(ostream &ostr, VALS &vals, const template_funs &dctFuns) const
+  {
+    ostream_sink out(ostr);
+    render(out, vals, dctFuns);
+  }
+
+#ifndef SPT_DEBUG
+  // Runs the program with values from a typed context
+  template<typename... FIELDS> void render(sink &out, const context<FIELDS...> &ctx, const template_funs &dctFuns) const
+  {
+    typed_vals<context<FIELDS...>> vals{ctx, slots()};
+    render(out, vals, dctFuns);
+  }
+#endif
+
+  // Pull based streaming render, each next() runs the program up to a <flush> tag or until a chunk is full
+  // Only one chunk is held at a time, so memory stays bounded however many iterations the loops run
+  class cursor
+  {
+    const program &m_prog;
+    bound_funs m_funs;
+    template_slots m_slots;
+    exec_state m_st;
+    string_sink m_out;
+    size_t m_nChunk;
+    bool m_bDone = false;
+
+  public:
+    cursor(const program &prog, const template_slots &slots, const template_funs &dctFuns, size_t nChunk):
+      m_prog(prog), m_funs(prog.bind(dctFuns)), m_slots(slots), m_out(nChunk), m_nChunk(nChunk)
+    {
+      m_st.arrFrames.reserve(prog.m_nMaxDepth);
+    }
+
+    // Renders the next chunk, returns false when the output is complete
+    bool next()
+    {
+      m_out.clear();
+      while(!m_bDone && !m_out.size())
+      {
+        m_bDone = !m_prog.exec(m_st, m_out, m_slots, m_funs, &m_out, m_nChunk);
+      }
+      return m_out.size() != 0;
+    }
+
+    // The current chunk
+    const char *data() const  { return m_out.data(); }
+    size_t size() const       { return m_out.size(); }
+    string str() const        { return m_out.str(); }
+  };
+
+  // Returns a cursor over the output, chunks end at <flush> tags or once they reach nChunk bytes
+  // The program and the functions in dctFuns must outlive the cursor, the values are copied
+  cursor stream(const template_slots &slots, const template_funs &dctFuns, size_t nChunk = 16384) const
+  {
+    return cursor(*this, slots, dctFuns, nChunk);
+  }
+
+  // Dumps the instructions
+  void dump() const
+  {
+    for(size_t i = 0; i < m_arrCode.size(); ++i)
+    {
+      const instr &in = m_arrCode[i];
+      cerr << i << ": op=" << int(in.op) << ",a=" << in.a << ",b=" << in.b << endl;
+    }
+  }
+};
+
+} // namespace spt
+
+#endif
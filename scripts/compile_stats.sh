@@ -0,0 +1,50 @@
+#!/bin/bash
+
+# Records the compile time and compiler memory of each test template
+# Time and GC memory come from g++ -ftime-report, peak RSS from GNU time if it is installed
+# Results go to compile_stats.txt in the repo root, the previous run is kept in compile_stats.prev.txt to compare against
+
+BLUE='\033[1;34m'
+NC='\033[0m' # No Color
+
+STATS=../compile_stats.txt
+PREV=../compile_stats.prev.txt
+
+printf "${BLUE}Compile time and memory\n"
+printf "${BLUE}----------------------------------------------------------------${NC}\n"
+
+cd ../test
+
+if [ -f $STATS ]; then
+  mv $STATS $PREV
+fi
+
+printf "%-40s %10s %10s %12s\n" "template" "wall (s)" "gc mem" "peak rss (k)" | tee $STATS
+
+for i in *.spt;
+do
+  node ../scripts/make_test.js $i > $i.cpp;
+
+  if [ -x /usr/bin/time ]; then
+    /usr/bin/time -f "%M" -o /tmp/$i.rss g++ -I.. -S --std=c++17 -ftime-report $i.cpp -o /dev/null &> /tmp/$i.report
+    RSS=$(tail -1 /tmp/$i.rss)
+  else
+    g++ -I.. -S --std=c++17 -ftime-report $i.cpp -o /dev/null &> /tmp/$i.report
+    RSS=-
+  fi
+
+  # TOTAL : usr sys wall ggc
+  read WALL MEM <<< $(grep "^ TOTAL" /tmp/$i.report | awk '{print $(NF-1), $NF}')
+  printf "%-40s %10s %10s %12s\n" $i ${WALL:--} ${MEM:--} $RSS | tee -a $STATS
+
+  rm -f $i.cpp /tmp/$i.report /tmp/$i.rss
+done
+
+if [ -f $PREV ]; then
+  echo
+  printf "${BLUE}Changes since the previous run\n"
+  printf "${BLUE}----------------------------------------------------------------${NC}\n"
+  diff $PREV $STATS
+fi
+
+printf "\n${BLUE}Done${NC}\n\n"
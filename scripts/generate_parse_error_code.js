@@ -17,6 +17,10 @@ const errs = [
   'Invalid_syntax_in_for_tag',
   'Invalid_syntax_in_if_tag',
   'Infinite_loop_in_for_tag',
+  'Unknown_template_key',
+  'Missing_value_for_template_key',
+  'Invalid_syntax_in_cache_tag',
+  'Template_too_large',
 ];
 
 function makeEnums(e) {return 'Error_' + e;}
@@ -28,6 +32,9 @@ const structs = errs.map(makeStruct).join('\n');
 function makeMsgToType(e) {return `template<> struct MsgToType<Error_${e}>{using type = ${e};}; `}
 const MsgToType = errs.map(makeMsgToType).join('\n');
 
+function makeName(e) {return `"${e}"`;}
+const names = errs.map(makeName).join(',\n  ');
+
 function makeWarner(e) {return `spt::IF<w.m == spt::${'Error_' + e}, spt::Warning<w.row, w.col, spt::MsgToType<w.m>::type>> ();  \\`}
 const warners = errs.map(makeWarner).join('\n  ');
 
@@ -53,6 +60,13 @@ template<Messages m> struct MsgToType{};
 template<> struct MsgToType<Error_None>{using type = None;};
 ${MsgToType}
 
+// Message names by enum value, for errors reported at runtime
+constexpr const char *g_arrMessageNames[] =
+{
+  "None",
+  ${names}
+};
+
 #ifndef SPT_DEBUG
 
 #define DUMP_WARNING(x)                                        \\
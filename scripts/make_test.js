@@ -15,10 +15,10 @@ int main()
   REPORT_ERRORS(parser);
   
   spt::tree spt_tree(parser);
-  spt::template_vals dct;
+  spt::template_slots dct = spt_tree.slots();
   spt::template_funs dctFuns;
     
-  spt_tree.root().render(cout, dct, dctFuns);
+  spt_tree.render(cout, dct, dctFuns);
   cout << endl;
 }
 `;
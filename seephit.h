@@ -6,18 +6,22 @@
 #include "parse_error.h"
 #include "tags.h"
 #include "util.h"
+#include "parallel.h"
+#include "cache.h"
 
-// maximum nodes and attributes in the tree
+// maximum nodes and IDs in a tree parsed with _html, SPT_PARSE sizes the parser from the text instead
 #define SPT_MAX_NODES 2048
-#define SPT_MAX_ATTRS 2048
+#define SPT_MAX_IDS 1024
 #define SPT_MAX_WARNINGS 20
 #define SPT_MAX_ATTR_PER_NODE 16
+#define SPT_MAX_KEYS 512
+
+// Bytes tree::estimate_size counts for a call to a function without a max_size
+#define SPT_FUN_SIZE 64
 
 namespace spt
 {
 
-using attrs = vec<attr, SPT_MAX_ATTRS>;
-using cnodes = vec<cnode, SPT_MAX_NODES>;
 using node_attrs = vec<attr, SPT_MAX_ATTR_PER_NODE>;
 using warnings = vec<Message, SPT_MAX_WARNINGS>;
 
@@ -36,14 +40,30 @@ constexpr const char_view g_symRoot{"root"};
 constexpr const char_view g_symText{"@text"};
 constexpr const char_view g_symAttr{"@attr"};
 
-// Compile time parser
-struct parser
+// Index of <pre> in g_arrTags, its text is not trimmed
+const int TAG_PRE = find_sym(g_arrTags, sizeof(g_arrTags) / sizeof(g_arrTags[0]), g_symPre);
+
+// Whether a tag is a control tag, these are matched case sensitively when rendering
+constexpr bool is_ctrl_tag(const char_view &tag)
+{
+  for(const char *psz: g_arrCtrlTags)
+  {
+    if(tag.cmpCase(char_view(psz)) == 0) return true;
+  }
+  return false;
+}
+
+// Compile time parser, with room for NNODES nodes and NIDS IDs
+template<size_t NNODES, size_t NIDS> struct basic_parser
 {
-  cnodes m_arrNodes;
-  sym_tab m_ids;
+  vec<cnode, NNODES> m_arrNodes;
+  sym_tab<NIDS> m_ids;
   warnings m_arrWarns;
   Messages m_arrErrs {};
   
+  // Hash of the template text, which is all of the output but the values, see tree::etag
+  uint64_t m_uHash = 0;
+  
   int m_iErrRow = -1;
   int m_iErrCol = -1;
   
@@ -54,7 +74,18 @@ struct parser
   // Macro to quit the current function if error
   #define ON_ERR_RETURN if(m_iErrRow > -1) return
     
-  constexpr explicit parser(const char *pszText): m_pszText(pszText), m_pszStart(pszText) {}
+  constexpr explicit basic_parser(const char *pszText): m_pszText(pszText), m_pszStart(pszText) {}
+  
+  // For text whose end is known, which lets a runtime parse skip runs of plain text and whitespace in blocks
+  // The text still has to end with a 0 byte at pszEnd
+  constexpr basic_parser(const char *pszText, const char *pszEnd): m_pszText(pszText), m_pszStart(pszText), m_pszEnd(pszEnd) {}
+  
+  // Parses the whole text and hashes it, see tree::etag
+  constexpr void parse()
+  {
+    parse_html(NULL_NODE);
+    m_uHash = hash_bytes(m_pszStart, m_pszEnd ? m_pszEnd - m_pszStart : std::char_traits<char>::length(m_pszStart));
+  }
 
   // Parse grammar
   // HTML     :: CONTENT | CONTENT HTML
@@ -64,11 +95,121 @@ struct parser
   // CLOSETAG :: "<" TAGNAME "/>"
   // TEXT     :: [~>&]+
   // symEndTag represents the point at which the parsing should stop
+  // The last child appended is tracked here so adding a child does not walk the sibling chain
   constexpr void parse_html(int iParentId)
   {
-    while(m_iErrRow == -1 && parse_content(iParentId));
+    // A node's attributes, if any, are its first child
+    int iYoungest = iParentId >= 0 ? m_arrNodes[iParentId].child : NULL_NODE;
+    while(m_iErrRow == -1 && parse_content(iParentId, iYoungest));
   }
       
+  // Start of the template text
+  constexpr const char *start() const { return m_pszStart; }
+  
+  // Return line number of a position in the text
+  constexpr int row_of(const char *pos) const
+  {
+    return text_row(m_pszStart, pos);
+  }
+  
+  // Return column number of a position in the text
+  constexpr int col_of(const char *pos) const
+  {
+    return text_col(m_pszStart, pos);
+  }
+  
+  // A node's tag, text and ID, the node keeps them as offsets into the template text
+  constexpr char_view tag(const cnode &node) const
+  {
+    if(node.iTag == TAG_TEXT) return g_symText;
+    if(node.iTag == TAG_ATTR) return g_symAttr;
+    return view(node.iName, node.nName);
+  }
+  
+  // A node's control tag, TAG_FOR and the like, or TAG_NONE if it is not one
+  // iTag is looked up case insensitively but only lower case control tags render as such, every engine checks both through this
+  constexpr int ctrl_tag(const cnode &node) const
+  {
+    return node.iTag <= TAG_CTRL && is_ctrl_tag(tag(node)) ? node.iTag : TAG_NONE;
+  }
+  
+  constexpr char_view text(const cnode &node) const
+  {
+    return view(node.iText, node.nText);
+  }
+  
+  constexpr char_view id(const cnode &node) const
+  {
+    return view(node.iId, node.nId);
+  }
+  
+  constexpr char_view tag(int index) const  { return tag(m_arrNodes[index]); }
+  constexpr char_view text(int index) const { return text(m_arrNodes[index]); }
+  
+  // Returns the value of an attribute of a node, empty if not present
+  constexpr char_view find_attr(int index, const char_view &symName) const
+  {
+    char_view ret;
+    int iAttrs = m_arrNodes[index].child;
+    if(iAttrs > NULL_NODE && m_arrNodes[iAttrs].iTag == TAG_ATTR)
+    {
+      for(int i = m_arrNodes[iAttrs].child; i > NULL_NODE; i = m_arrNodes[i].sibling)
+      {
+        if(m_arrNodes[i].nName == symName.size() && tag(i) == symName) ret = text(i);
+      }
+    }
+    return ret;
+  }
+  
+  // Calls fnAttr(name, value) for each attribute of a node in source order
+  // A repeated attribute keeps the position of its first occurrence and the value of its last
+  template<typename F> constexpr void for_each_attr(int index, F fnAttr) const
+  {
+    int iAttrs = m_arrNodes[index].child;
+    if(iAttrs > NULL_NODE && m_arrNodes[iAttrs].iTag == TAG_ATTR)
+    {
+      int iFirst = m_arrNodes[iAttrs].child;
+      for(int i = iFirst; i > NULL_NODE; i = m_arrNodes[i].sibling)
+      {
+        // Skip if seen before
+        bool bSeen = false;
+        for(int j = iFirst; j != i && !bSeen; j = m_arrNodes[j].sibling)
+        {
+          bSeen = m_arrNodes[j].nName == m_arrNodes[i].nName && tag(j) == tag(i);
+        }
+        
+        if(!bSeen) fnAttr(tag(i), find_attr(index, tag(i)));
+      }
+    }
+  }
+  
+  // Returns the loop bounds of a for tag, the same integers check_for_tag verified
+  constexpr loop_params for_params(int index) const
+  {
+    char_view symInc = find_attr(index, "inc");
+    loop_params ret;
+    ret.iFrom = find_attr(index, "from").toInt();
+    ret.iTo = find_attr(index, "to").toInt();
+    ret.iInc = symInc.empty() ? 1 : symInc.toInt();
+    return ret;
+  }
+  
+  // Copies the parse into a parser with room for exactly NNODES2 nodes and NIDS2 IDs, see SPT_PARSE
+  template<size_t NNODES2, size_t NIDS2> constexpr basic_parser<NNODES2, NIDS2> compact() const
+  {
+    basic_parser<NNODES2, NIDS2> ret(m_pszStart);
+    for(const auto &node: m_arrNodes) ret.m_arrNodes.push_back(node);
+    for(const auto &sym: m_ids.m_arrSyms) ret.m_ids.m_arrSyms.push_back(sym);
+    ret.m_arrWarns = m_arrWarns;
+    ret.m_arrErrs = m_arrErrs;
+    ret.m_uHash = m_uHash;
+    ret.m_iErrRow = m_iErrRow;
+    ret.m_iErrCol = m_iErrCol;
+    ret.m_iElder = m_iElder;
+    ret.m_pszText = m_pszText;
+    return ret;
+  }
+  
   // Dumps the tree nodes linearly
   void dump() const 
   {
@@ -76,12 +217,16 @@ struct parser
     for(const auto &node: m_arrNodes )
     {
       cerr << "n=" << i++ << ",";
-      node.dump();
-      cerr << endl;
+      cerr << "sibling=" << node.sibling << ",";
+      cerr << "child=" << node.child << ",";
+      cerr << "tag=" << tag(node) << ",";
+      cerr << "id=" << id(node) << ",";
+      cerr << "text=" << text(node) << endl;
     }
   }
  
 private:
+  template<size_t, size_t> friend struct basic_parser;
 
   // Helper for error handling construct
   struct saver
@@ -96,29 +241,56 @@ private:
   // Use as follows: WITH_SAVE_POS { ... }
   #define WITH_SAVE_POS for(saver s(m_pszText); s.done; m_pszText = s.finish())
   #define INDEX_OF(ELEM, ARR) find_arr(ARR, (sizeof(ARR) / sizeof(ARR[0])), ELEM) 
+  #define FIND_SYM(SYM, ARR) find_sym(ARR, (sizeof(ARR) / sizeof(ARR[0])), SYM)
   
   const char *m_pszText = nullptr;  // Position in the stream
   const char *m_pszStart = nullptr;
+  const char *m_pszEnd = nullptr;   // End of the text if known, only for runtime parses
   
   // Return line number of current position
   constexpr int cur_row() const
   {
-    // Count the number of newlines
-    int n = 0;
-    for(auto p = m_pszStart; p != m_pszText; ++p)
-    {
-      if(*p == '\n') ++n;
-    }
-    return n + 1;
+    return row_of(m_pszText);
   }
   
   // Return column number of current position
   constexpr int cur_col() const
   {
-    // Count the number of chars to reach \n or beginning
-    int n = 0;
-    for(auto p = m_pszText; p != m_pszStart && *p-- != '\n'; ++n);
-    return n;
+    return col_of(m_pszText);
+  }
+  
+  // A symbol in the template text from its offset and length
+  constexpr char_view view(uint32_t iOffset, uint32_t nLen) const
+  {
+    return char_view(m_pszStart + iOffset, m_pszStart + iOffset + nLen);
+  }
+  
+  // Offset of a symbol in the template text, an empty symbol may point anywhere so it is 0
+  constexpr uint32_t offset_of(const char_view &sym) const
+  {
+    return sym.empty() ? 0 : uint32_t(sym.begin() - m_pszStart);
+  }
+  
+  // Appends a node with a name and text from the template text
+  // Names are kept to 16 bits, nothing that long is an identifier
+  constexpr cnode &add_node(int iTag, const char_view &name, const char_view &text = {})
+  {
+    if(name.size() > 0xFFFF)
+    {
+      WITH_SAVE_POS
+      {
+        m_pszText = name.begin();
+        PARSE_ERR(Error_Expecting_an_identifier);
+      }
+    }
+    
+    cnode node(iTag);
+    node.iName = offset_of(name);
+    node.nName = uint16_t(name.size());
+    node.iText = offset_of(text);
+    node.nText = text.size();
+    m_arrNodes.push_back(node);
+    return m_arrNodes.back();
   }
   
   // Raises compiletime error if no more characters left to parse
@@ -132,6 +304,7 @@ private:
   constexpr void eat_space()
   {
     check_eos();
+    if(m_pszEnd) m_pszText = skip_space(m_pszText, m_pszEnd);
     while(*m_pszText && *m_pszText <= 32) ++m_pszText;
   }
   
@@ -156,7 +329,7 @@ private:
   }
   
   // Tries to consume the string pszSym
-  constexpr const bool eat_str(const char *pszSym)
+  constexpr bool eat_str(const char *pszSym)
   {
     // As long as we dont hit the end
     while(*pszSym)
@@ -200,48 +373,12 @@ private:
     return sym;
   }
   
-  // Checks if we have an open tag
-  constexpr bool is_open_tag()
-  {
-    auto saved = m_pszText;
-    eat_space();
-    
-    // Look for open tag and an alphanumeric character
-    if( m_pszText[0] == '<')
-    {
-      if(is_alpha(m_pszText[1])) 
-      {
-        m_pszText = saved;
-        return true;
-      }
-      
-      // If its not an open tag, it has to be a close tag, else its invalid
-      if(m_pszText[1] != '/') 
-      {
-        m_pszText++;
-        PARSE_ERR(Error_Expecting_a_tag_name_after_open_bracket);
-      }
-    }
-    
-    m_pszText = saved;
-    return false;
-  }
-  
-  // Checks if we have a close tag, returns the tag symbol
-  constexpr bool is_close_tag()
+  // Returns the first non-whitespace character from the current position, without consuming anything
+  constexpr const char *peek_space() const
   {
-    // Save the pointer, eat whitespace
-    WITH_SAVE_POS
-    {
-      eat_space();
-      
-      // Check for "</" followed by alpha
-      if(m_pszText[0] == '<' && m_pszText[1] == '/')
-      {
-        return is_alpha(m_pszText[2]);
-      }
-    }
-    return false;
+    const char *p = m_pszEnd ? skip_space(m_pszText, m_pszEnd) : m_pszText;
+    while(*p && *p <= 32) ++p;
+    return p;
   }
   
   // Parses one attribute like NAME=VALUE
@@ -305,7 +442,12 @@ private:
           }
           
           // Add the ID to the array of IDs
-          m_arrNodes.back().id = value;
+          m_arrNodes.back().iId = offset_of(value);
+          m_arrNodes.back().nId = value.size();
+        }
+        else if(attrs.size() == SPT_MAX_ATTR_PER_NODE)
+        {
+          PARSE_ERR(Error_Template_too_large);
         }
         else // Regular attribute, accumulate it
         {
@@ -321,7 +463,14 @@ private:
         }
         
         // Add the attribute to the list
-        attrs.push_back(attr(name, name));
+        if(attrs.size() == SPT_MAX_ATTR_PER_NODE)
+        {
+          PARSE_ERR(Error_Template_too_large);
+        }
+        else
+        {
+          attrs.push_back(attr(name, name));
+        }
       }
       
       return true;
@@ -341,6 +490,26 @@ private:
     }
   }
   
+  // verifies a cache tag
+  // <cache key='{{user}}' ttl=60> ... both are optional, ttl is in whole seconds
+  constexpr void check_cache_tag(node_attrs &attrs)
+  {
+    for(size_t i = 0; i < attrs.size(); ++i)
+    {
+      bool bValid = attrs[i].name == "key";
+      if(attrs[i].name == "ttl")
+      {
+        bValid = true;
+        for(char ch: attrs[i].value) bValid = bValid && is_digit(ch);
+      }
+      
+      if(!bValid)
+      {
+        PARSE_ERR(Error_Invalid_syntax_in_cache_tag);
+      }
+    }
+  }
+  
   // verifies a for tag 
   // <for var=name from=N to=N [inc=N]> ...
   constexpr void check_for_tag(node_attrs &attrs)
@@ -382,20 +551,27 @@ private:
     if(!eat_str("<")) PARSE_ERR(Error_Missing_open_bracket);
     
     // Try to parse an [a-z0-9]+ as a tag - 
-    // is_open_tag would have already ensure first char is [a-z]
+    // parse_content would have already ensured first char is [a-z]
     char_view sym = eat_only(is_alnum);
 
     DUMP << "Parsed open tag: " << sym << ENDL;
     
+    // Look the tag up once, control tags are rare so they are searched second
+    int iTag = FIND_SYM(sym, g_arrTags);
+    if(iTag == -1)
+    {
+      int iCtrl = FIND_SYM(sym, g_arrCtrlTags);
+      if(iCtrl != -1) iTag = TAG_CTRL - iCtrl;
+    }
+    
     // add a node 
-    m_arrNodes.push_back(cnode(sym));
-    cnode &node = m_arrNodes.back();
+    cnode &node = add_node(iTag, sym);
     
     // Eat any trailing whitespace
     eat_space();
     
-    // Check if valid tag
-    if(INDEX_OF(sym.m_pBeg, g_arrCtrlTags) == -1 && INDEX_OF(sym.m_pBeg, g_arrTags) == -1)
+    // Check if valid tag, INDEX_OF also takes a tag that starts with a known one, so that is still checked
+    if(iTag == TAG_NONE && INDEX_OF(sym.m_pBeg, g_arrCtrlTags) == -1 && INDEX_OF(sym.m_pBeg, g_arrTags) == -1)
     {
       WITH_SAVE_POS
       {
@@ -409,17 +585,21 @@ private:
     ON_ERR_RETURN false;
     
     // Check for control nodes, if and for, verify if they have the required attrs
-    if(node.tag == g_symFor)
+    if(node.iTag == TAG_FOR)
     {
       check_for_tag(attrs);
     }
-    else if(node.tag == g_symIf)
+    else if(node.iTag == TAG_IF)
     {
       check_if_tag(attrs);
     }
+    else if(node.iTag == TAG_CACHE)
+    {
+      check_cache_tag(attrs);
+    }
     
     // Check if void tag
-    bool bIsVoidTag = INDEX_OF(node.tag.m_pBeg, arrVoidTags) != -1;
+    bool bIsVoidTag = INDEX_OF(sym.m_pBeg, arrVoidTags) != -1 || iTag == TAG_FLUSH;
     if(bIsVoidTag)
     {
       // Void tag, optionally eat the "/" too
@@ -487,18 +667,18 @@ private:
     if(attrs.size())
     {
       // Create a "attr" node, make it the child of this
-      m_arrNodes.push_back(cnode(g_symAttr));
-      cnode &nodeAttrs = m_arrNodes.back();
-      node.child = m_arrNodes.size() - 1;
+      m_arrNodes.push_back(cnode(TAG_ATTR));
+      int iAttrs = m_arrNodes.size() - 1;
+      node.child = iAttrs;
       
       // Add the first attribute as the child of the "attr" node
-      m_arrNodes.push_back(cnode(attrs[0].name, attrs[0].value));
-      int iYoungest = nodeAttrs.child = m_arrNodes.size() - 1;
+      add_node(TAG_NONE, attrs[0].name, attrs[0].value);
+      int iYoungest = m_arrNodes[iAttrs].child = m_arrNodes.size() - 1;
       
       // Add the rest by chaining as siblings
       for(size_t i = 1; i < attrs.size(); ++i)
       {
-        m_arrNodes.push_back(cnode(attrs[i].name, attrs[i].value));
+        add_node(TAG_NONE, attrs[i].name, attrs[i].value);
         m_arrNodes[iYoungest].sibling = m_arrNodes.size() - 1;
         iYoungest = m_arrNodes.size() - 1;
       }
@@ -524,7 +704,7 @@ private:
       parse_html(iCurrId);
       
       // Finally parse the close tag
-      parse_close_tag(node.tag);
+      parse_close_tag(tag(node));
     }
     else
     {
@@ -534,444 +714,1468 @@ private:
     return iCurrId;
   }
   
-  constexpr void check_template_braces(const char_view &text)
+  // Parse text until a <, forbidding >, optionally trims whitespace on bothe ends
+  // Braces are checked in the same pass, each {{ must have a matching }}
+  constexpr int parse_text(bool bTrim)
   {
-    int nBrace = 0;
-    auto p = text.begin();
+    ON_ERR_RETURN 0;
+    
+    // make sure we have something
+    check_eos();
     
-    while(p != text.end())
+    const char *p = m_pszText;
+    int nBrace = 0;
+    for(; *p && *p != '<'; ++p)
     {
-      // Check for {{
+      // An unexpected char is an error at its position
+      if(*p == '>')
+      {
+        WITH_SAVE_POS
+        {
+          m_pszText = p;
+          PARSE_ERR(Error_Unexpected_character_inside_tag_content);
+        }
+        break;
+      }
+      
+      // Check for {{, or if we had one before check for a }}
       if(p[0] == '{' && p[1] == '{')
       {
         ++nBrace;
       }
-      else
+      else if(nBrace && p[0] == '}' && p[1] == '}')
       {
-        // If we had one before check for a }}
-        if(nBrace)
-        {
-          if(p[0] == '}' && p[1] == '}')
-          {
-            --nBrace;
-          }
-        }
+        --nBrace;
       }
       
-      ++p;
+      // Runtime parses jump to the byte before the next one the loop has to look at
+      if(m_pszEnd) p = skip_plain(p + 1, m_pszEnd) - 1;
     }
+    char_view text(m_pszText, p);
+    m_pszText = p;
+    
+    // Make sure we have something left
+    check_eos();
     
     // If the counts mismatch, raise error
     if(nBrace)
     {
       PARSE_ERR(Error_Missing_close_brace_in_template);
     }
-  }
-  
-  // Parse text until a <, forbidding & and >, optionally trims whitespace on bothe ends
-  constexpr int parse_text(bool bTrim)
-  {
-    ON_ERR_RETURN 0;
-    
-    // make sure we have something
-    check_eos();
-    bool contentUnexpectedChars[256] = {false};
-    contentUnexpectedChars[int('>')] = true;
-    auto text = eat_until('<', contentUnexpectedChars);
-    
-    // Make sure we have something left
-    check_eos();
-        
-    // Check if the braces are {{ matching }}
-    check_template_braces(text);
     
     // Trim whitespace if needed
     if(bTrim) text.trim();
    
     // Add a text meta node and return its index
-    m_arrNodes.push_back(cnode(g_symText, text));
+    add_node(TAG_TEXT, {}, text);
     return m_arrNodes.size() - 1;
   }
   
   // CONTENT  :: TEXT | TAG
-  constexpr const bool parse_content(int iParentId)
+  // iYoungest is the last child of the parent so far, the new child is chained after it
+  constexpr bool parse_content(int iParentId, int &iYoungest)
   {
     // If we are out of text, were done
-    // Else if we found a close tag, were done
-    if(*m_pszText && !is_close_tag() && m_iErrRow == -1)
+    if(!*m_pszText || m_iErrRow != -1) return false;
+    
+    // Look past any whitespace once to see what comes next
+    const char *p = peek_space();
+    
+    // If we found a close tag, were done
+    if(p[0] == '<' && p[1] == '/' && is_alpha(p[2])) return false;
+    
+    // Otherwise a < has to start an open tag
+    bool bIsOpenTag = p[0] == '<' && is_alpha(p[1]);
+    if(p[0] == '<' && !bIsOpenTag && p[1] != '/')
     {
-      // Parse either an open tag or text, get the new child nodes ID
-      int iChild = -1;
-      bool bIsOpenTag = is_open_tag();
-      ON_ERR_RETURN false;
-      
-      if(bIsOpenTag)
+      WITH_SAVE_POS
       {
-        iChild = parse_tag();
+        m_pszText = p + 1;
+        PARSE_ERR(Error_Expecting_a_tag_name_after_open_bracket);
       }
-      else
+      return false;
+    }
+    
+    // Parse either an open tag or text, get the new child nodes ID
+    int iChild = NULL_NODE;
+    if(bIsOpenTag)
+    {
+      m_pszText = p;
+      iChild = parse_tag();
+    }
+    else
+    {
+      // Trim the text unless the parent node is a <pre>
+      iChild = parse_text(m_arrNodes[iParentId].iTag != TAG_PRE);
+    }
+    ON_ERR_RETURN false;
+    
+    // If it's not the topmost level
+    if(iParentId >= 0)
+    {
+      // Assign us as the last sibling, or the parents "firstborn" if it has no child yet
+      if(iYoungest != NULL_NODE)
+      {
+        m_arrNodes[iYoungest].sibling = iChild;
+      }
+      else 
+      {
+        m_arrNodes[iParentId].child = iChild;
+      }
+      iYoungest = iChild;
+    }
+    else // This is a top level node with no parent
+    {
+      // Do we know of an elder?
+      if(m_iElder > -1)
+      {
+        // Set us to be the sibling of that elder
+        m_arrNodes[m_iElder].sibling = iChild;
+      }
+      
+      // We are the youngest elder
+      m_iElder = iChild;
+    }
+    
+    return true;
+  }
+};
+
+// The parser _html returns, sized for the biggest template
+using parser = basic_parser<SPT_MAX_NODES, SPT_MAX_IDS>;
+
+// Parses a template into a parser with room for NNODES nodes and NIDS IDs
+template<size_t NNODES, size_t NIDS> constexpr basic_parser<NNODES, NIDS> parse(const char *pszText)
+{
+  basic_parser<NNODES, NIDS> parser(pszText);
+  parser.parse();
+  return parser;
+}
+
+// Upper bounds on the nodes, IDs, keys and functions a template parses into, from a single scan of the text
+// Each open tag can make a node, an @attr node and one node per word in the tag, and each run of text a node
+// Quotes are followed so a > or a space in an attribute value does not throw the count off
+struct parse_capacity
+{
+  size_t nNodes = 0;
+  size_t nIds = 0;
+  
+  // Keys and function names, see template_keys
+  size_t nKeys = 0;
+  size_t nFuns = 0;
+  
+  constexpr explicit parse_capacity(const char *pszText)
+  {
+    bool bInTag = false, bInText = false, bSpace = false;
+    char chQuote = 0;
+    for(const char *p = pszText; *p; ++p)
+    {
+      // Each id attribute adds an ID, even a repeated one on the same tag
+      // Anything in a tag that reads id and is not followed by more of a name counts, so this stays an upper bound
+      if(bInTag && to_lower(p[0]) == 'i' && to_lower(p[1]) == 'd' && !is_attr(p[2])) ++nIds;
+      
+      // A {{key}} names one key, a {{$fn@param}} a function and a key, and a var attribute a loop variable
+      if(p[0] == '{' && p[1] == '{')
       {
-        // Trim the text unless the parent node is a <pre>
-        iChild = parse_text(m_arrNodes[iParentId].tag != g_symPre);
+        ++nKeys;
+        ++nFuns;
       }
-      ON_ERR_RETURN false;
+      if(bInTag && to_lower(p[0]) == 'v' && to_lower(p[1]) == 'a' && to_lower(p[2]) == 'r' && !is_attr(p[3])) ++nKeys;
       
-      // If it's not the topmost level
-      if(iParentId >= 0)
+      if(!bInTag)
       {
-        // Does parent have a child?
-        if(m_arrNodes[iParentId].child != -1)
+        if(*p == '<')
         {
-          // Walk down the sibling chain to get the last child
-          int iYoungest = m_arrNodes[iParentId].child;
-          while(m_arrNodes[iYoungest].sibling != -1)
-          {
-            iYoungest = m_arrNodes[iYoungest].sibling;
-          }
-          
-          // Assign us as the last sibling 
-          m_arrNodes[iYoungest].sibling = iChild;
+          bInTag = true;
+          bInText = bSpace = false;
+          if(p[1] != '/') nNodes += 2;
         }
-        else 
+        else if(!bInText)
         {
-          // Assign the parents "firstborn" to us
-          m_arrNodes[iParentId].child = iChild;
+          ++nNodes;
+          bInText = true;
         }
       }
-      else // This is a top level node with no parent
+      else if(chQuote)
       {
-        // Do we know of an elder?
-        if(m_iElder > -1)
+        // An attribute can follow a quoted value without a space
+        if(*p == chQuote)
         {
-          // Set us to be the sibling of that elder
-          m_arrNodes[m_iElder].sibling = iChild;
+          chQuote = 0;
+          bSpace = true;
         }
-        
-        // We are the youngest elder
-        m_iElder = iChild;
       }
-      
-      return true;
+      else if(*p == '"' || *p == '\'')
+      {
+        chQuote = *p;
+      }
+      else if(*p == '>')
+      {
+        bInTag = false;
+      }
+      else if(*p <= 32)
+      {
+        bSpace = true;
+      }
+      else if(bSpace)
+      {
+        ++nNodes;
+        bSpace = false;
+      }
     }
-    
-    return false;
   }
 };
 
-// Runtime tree node
-class rnode
+// A template key found at compile time, and where it first occurs in the text
+struct template_key
+{
+  // Name of the first use, which is also where errors about the key point to
+  char_view name;
+  
+  // Loop variables are bound by <for> tags rather than by the caller
+  bool bLoopVar = false;
+  
+  // Names only used as the param of {{$fn@param}}, which the function reads rather than the template rendering it
+  bool bParam = false;
+};
+
+// Compile time list of the template keys and loop variables in a parsed template
+// Keys are listed in the order the runtime tree assigns slots, so the index of a key is its slot id
+// Holds at most NKEYS keys and NFUNS function names, SPT_KEYS sizes it from the text
+template<size_t NKEYS = SPT_MAX_KEYS, size_t NFUNS = NKEYS> struct template_keys
 {
-  friend class tree;
+  vec<template_key, NKEYS> m_arrKeys;
   
-  using attr_dict = unordered_map<string, string>; 
+  // Names of the functions called, ids are the same as the runtime tree gives them
+  vec<char_view, NFUNS> m_arrFuns;
   
-  // children if any
-  vector<rnode> m_arrChildren;
+  // Start of the template text, for the row and column of a key
+  const char *m_pszStart = nullptr;
   
-  // attributes of this node
-  attr_dict m_dctAttrs;
+  // First key or function name there was no room for, see too_large
+  char_view m_symOverflow;
   
-  // node tag, content text and id
-  char_view m_symTag, m_symText, m_symId;
+  template<typename PARSER> constexpr explicit template_keys(const PARSER &parser): m_pszStart(parser.start())
+  {
+    if(parser.m_arrNodes.size()) collect(parser, 0);
+  }
   
-  // If content has template tags of the form {{key}}, store them in this
-  template_text m_templates;
+  constexpr size_t size() const { return m_arrKeys.size(); }
   
-  // Whether it's a void node
-  bool m_bVoidNode {};
+  // True if the template has more keys or functions than the lists hold, which are then incomplete
+  constexpr bool too_large() const { return m_symOverflow.begin() != nullptr; }
+  constexpr int overflow_row() const { return text_row(m_pszStart, m_symOverflow.begin()); }
+  constexpr int overflow_col() const { return text_col(m_pszStart, m_symOverflow.begin()); }
   
-  // Render the children of this node recursively
-  void render_children(ostream &ostr, template_vals &dctVals, template_funs &dctFuns, int indent)
+  // Returns the id of a key, or NULL_NODE if the template does not use it
+  // Keys are case sensitive just like the slots of the runtime tree
+  constexpr int index(const char_view &sym) const
   {
-    for(auto& child: m_arrChildren)
+    for(size_t i = 0; i < m_arrKeys.size(); ++i)
     {
-      child.render(ostr, dctVals, dctFuns, indent);
+      if(m_arrKeys[i].name.cmpCase(sym) == 0) return i;
     }
+    return NULL_NODE;
   }
   
-  // Render the children in a for tag
-  void render_for(ostream &ostr, template_vals &dctVals, template_funs &dctFuns, int indent)
+  // Returns the id of a function, or NULL_NODE if the template does not call it
+  constexpr int fun_index(const char_view &sym) const
   {
-    // Get the for loop params
-    auto iStart = std::stoi(m_dctAttrs.at("from"));
-    auto iStop = std::stoi(m_dctAttrs.at("to"));
-    auto iInc = m_dctAttrs.count("inc") ? std::stoi(m_dctAttrs.at("inc")) : 1;
-    string sVar = m_dctAttrs.at("var");
-    
-    // Save the existing variable if any (allows nested loops with same var)
-    bool bUsed = dctVals.count(sVar);
-    template_val varSaved;
-    if(bUsed) varSaved = dctVals.at(sVar);
-    
-    // Loop and render
-    for(int i = iStart; iInc > 0 ? i < iStop : i > iStop; i += iInc)
-    {
-      dctVals[sVar] = i;
-      render_children(ostr, dctVals, dctFuns, indent);
-    }
-    
-    // Restore the loop var in the template dictionary or delete it if it didnt exits before
-    if(bUsed)
-    {
-      dctVals[sVar] = varSaved;
-    }
-    else
+    for(size_t i = 0; i < m_arrFuns.size(); ++i)
     {
-      dctVals.erase(sVar);
+      if(m_arrFuns[i].cmpCase(sym) == 0) return i;
     }
+    return NULL_NODE;
   }
   
-  // Render an if tag
-  void render_if(ostream &ostr, template_vals &dctVals, template_funs &dctFuns, int indent)
+  // Row and column of the first use of a key, only worked out when an error is reported
+  constexpr int row(int iKey) const { return text_row(m_pszStart, m_arrKeys[iKey].name.begin()); }
+  constexpr int col(int iKey) const { return text_col(m_pszStart, m_arrKeys[iKey].name.begin()); }
+  
+  // Returns the position of the first id that is not a key, or NULL_NODE if all are valid
+  constexpr int find_unknown(const int *pIds, size_t nIds) const
   {
-    if(std::stoi(m_dctAttrs.at("cond")))
+    for(size_t i = 0; i < nIds; ++i)
     {
-      render_children(ostr, dctVals, dctFuns, indent);
+      if(pIds[i] < 0 || pIds[i] >= int(m_arrKeys.size())) return i;
     }
+    return NULL_NODE;
   }
   
-public:
-  rnode() = default;
-
-  rnode(const char_view &tag, const char_view &text, bool bVoidNode, int index) 
-  : m_symTag(tag), m_symText(text), m_bVoidNode(bVoidNode) 
+  // Returns the id of the first key (other than loop variables and params) missing from pIds, or NULL_NODE
+  constexpr int find_missing(const int *pIds, size_t nIds) const
   {
-    // Iterate through the text and detect if we have a template strings
-    const char *szOpen = "{{";
-    const char *szClose = "}}";
-    
-    auto itCurr = text.begin();
-    do
+    for(size_t i = 0; i < m_arrKeys.size(); ++i)
     {
-      // Find a "{{"
-      auto itStart = std::search(itCurr, text.end(), szOpen, szOpen + 2);
-      
-      // The part from itCurr to itStart is a non template chunk iff itCurr != itStart
-      if(itCurr != itStart)
+      bool bFound = m_arrKeys[i].bLoopVar || m_arrKeys[i].bParam;
+      for(size_t j = 0; j < nIds && !bFound; ++j)
       {
-        m_templates.add(char_view(itCurr, itStart), false);
-        itCurr = itStart;
+        bFound = pIds[j] == int(i);
       }
       
-      // Now either itStart is at {{ or its text.end()
-      if(itStart != text.end())
-      {
-        // find the closing }}, if found add this chunk as a template
-        auto itEnd = std::search(itStart, text.end(), szClose, szClose + 2);
-        if(itEnd != text.end())
-        {
-          // Check if non empty tag
-          if((itEnd - itStart) > 2)
-          {
-            char_view sKey(itStart + 2, itEnd);
-            m_templates.add(sKey, true);
-          }
-          else
-          {
-            cerr << "Found an empty template tag {{}}";
-          }
-          
-          // Set the current pointer beyond the template }}
-          itCurr = itEnd + 2;
-        }
-        else  
-        {
-          // Set the current pointer to the end;
-          itCurr = text.end();
-        }
-      }
-    } 
-    while(itCurr != text.end());
+      if(!bFound) return i;
+    }
+    return NULL_NODE;
   }
   
-  void render(ostream &ostr, template_vals &dctVals, template_funs &dctFuns, int indent = 0)
+private:
+  
+  // Adds a key if not seen before, a name used as a loop variable anywhere is a loop variable
+  // and a name is a param only if nothing but function params use it
+  constexpr void add(const char_view &sym, bool bLoopVar, bool bParam = false)
   {
-    string sIndent(indent * 2, ' ');
-    string sTag{m_symTag.m_pBeg, m_symTag.m_pEnd};
-
-    bool bCtrlNode = false;
-    bool bTextNode = m_symTag == g_symText;
+    int iKey = index(sym);
+    if(iKey == NULL_NODE && m_arrKeys.size() == NKEYS)
+    {
+      overflow(sym);
+      return;
+    }
     
-    // Check if the tag is a control tag
-    for(const char *p: g_arrCtrlTags)
+    if(iKey == NULL_NODE)
     {
-      if(p == sTag)
-      {
-        bCtrlNode = true;
-        break;
-      }
+      template_key key;
+      key.name = sym;
+      key.bParam = bParam;
+      iKey = m_arrKeys.push_back(key);
     }
+    else if(!bParam)
+    {
+      m_arrKeys[iKey].bParam = false;
+    }
+    
+    if(bLoopVar) m_arrKeys[iKey].bLoopVar = true;
+  }
+  
+  // Adds a function name if not seen before
+  constexpr void add_fun(const char_view &sym)
+  {
+    if(fun_index(sym) != NULL_NODE) return;
     
-    // For non text nodes we render tags
-    if(!bTextNode)
+    if(m_arrFuns.size() == NFUNS)
+    {
+      overflow(sym);
+    }
+    else
+    {
+      m_arrFuns.push_back(sym);
+    }
+  }
+  
+  constexpr void overflow(const char_view &sym)
+  {
+    if(!too_large()) m_symOverflow = sym;
+  }
+  
+  // Adds the {{key}} parts of a text and the params of function calls, whose names are collected too
+  // A param gets its slot where it is first seen, like template_text::add gives it one
+  constexpr void collect_text(const char_view &text)
+  {
+    split_text(text, [&](const char_view &sym, bool bIsTemplate)
     {
-      // Ignore tag for control nodes
-      if(!bCtrlNode)
+      if(bIsTemplate && sym.front() != '$') 
       {
-        // Render the open tag, and the ID if any
-        ostr << sIndent << "<" << m_symTag;
-        
-        if(!m_symId.empty())
-        {
-          ostr << " ID" << "='" << m_symId << '\'';
-        }
-        
-        // Render the attributes and close the >
-        for(const auto &attr: m_dctAttrs )
-        {
-          ostr << ' ' << attr.first << '=' << '\'' << attr.second << '\'';
-        }
-        ostr << ">";
-        
-        // If tag has children add a newline
-        if(!m_arrChildren.empty()) 
-        {
-          ostr << '\n';
-          
-          // Render children if any
-          render_children(ostr, dctVals, dctFuns, indent + 1);
-        }
+        char_view symName;
+        value_format fmt;
+        split_key(sym, symName, fmt);
+        add(symName, false);
       }
-      else // control tags, do not indent
+      else if(bIsTemplate)
+      {
+        char_view symName, symParam;
+        split_fun(sym, symName, symParam);
+        add_fun(symName);
+        if(!symParam.empty()) add(symParam, false, true);
+      }
+    });
+  }
+  
+  // Walks a sibling chain in the same order as tree::build
+  // A node's content keys come first, then the keys in its attribute values, then a loop variable
+  template<typename PARSER> constexpr void collect(const PARSER &parser, int index)
+  {
+    for(; index > NULL_NODE; index = parser.m_arrNodes[index].sibling)
+    {
+      const cnode &node = parser.m_arrNodes[index];
+      collect_text(parser.text(node));
+      
+      int iChild = node.child;
+      if(iChild > NULL_NODE && parser.m_arrNodes[iChild].iTag == TAG_ATTR)
       {
-        // Render children conditionally for if
-        if(m_symTag == g_symIf)
+        // The loop variable of a for tag comes before the loop body
+        int iCtrl = parser.ctrl_tag(node);
+        if(iCtrl == TAG_FOR)
         {
-          render_if(ostr, dctVals, dctFuns, indent);
+          for(int iAttr = parser.m_arrNodes[iChild].child; iAttr > NULL_NODE; iAttr = parser.m_arrNodes[iAttr].sibling)
+          {
+            if(parser.tag(iAttr) == "var") add(parser.text(iAttr), true);
+          }
         }
-        else if(m_symTag == g_symFor)
+        else if(iCtrl == TAG_NONE)
         {
-          render_for(ostr, dctVals, dctFuns, indent);
+          parser.for_each_attr(index, [&](const char_view &, const char_view &symValue)
+          {
+            collect_text(symValue);
+          });
         }
-        else
+        else if(iCtrl == TAG_CACHE)
         {
-          render_children(ostr, dctVals, dctFuns, indent);
+          collect_text(parser.find_attr(index, "key"));
         }
+        
+        iChild = parser.m_arrNodes[iChild].sibling;
       }
+      
+      collect(parser, iChild);
     }
-    
-    // Skip text and close tag for void tags and control tags
-    if(!m_bVoidNode)
+  }
+};
+
+// What a runtime node is, decided once when the tree is built so render does not compare tags
+enum node_kind : unsigned char
+{
+  NK_ELEMENT,
+  NK_VOID,
+  NK_TEXT,
+  NK_IF,
+  NK_FOR,
+  NK_ROOT,
+  NK_FLUSH,
+  NK_CACHE
+};
+
+// Runtime tree node, the tree keeps all of them in one array in document preorder
+// The subtree of the node at index is [index, iEnd), its first child follows it and a child's iEnd is its next sibling
+// Text and tags are ranges of the tree's template_text, so nodes are plain values with nothing of their own to allocate
+struct rnode
+{
+  node_kind kind = NK_ELEMENT;
+  
+  // Whether it's a void node
+  bool bVoid = false;
+  
+  // Condition of an if tag, taken from the parser when the tree is built
+  bool bCond = false;
+  
+  // One past the last node of the subtree
+  int iEnd = 0;
+  
+  // Parts of the open tag with the ID and the attributes, serialized once when the tree is built
+  // {{key}} holes in attribute values are parts of it, for a cache tag these are the parts of its key
+  int iOpen = 0;
+  int iOpenEnd = 0;
+  
+  // Parts of the content text, if it has template tags of the form {{key}} they are parts of it
+  int iText = 0;
+  int iTextEnd = 0;
+  
+  // Close tag, a range of the text buffer
+  int iClose = 0;
+  int nClose = 0;
+  
+  // Slot of the loop variable of a for tag, its parameters and the index of the functions called in its body
+  int iVarSlot = NULL_NODE;
+  int iLoopFuns = NULL_NODE;
+  loop_params loop;
+  
+  // Index of the settings of a cache tag, see tree::cache_info
+  int iCache = NULL_NODE;
+  
+  // Bytes of markup, text and indentation the node writes itself, not counting its children or its keys' values
+  int nBytes = 0;
+  
+  // Output of a static subtree, rendered when the tree is built, a range of the text buffer
+  // NULL_NODE if the subtree has keys, or is inside a static subtree
+  int iStatic = NULL_NODE;
+  int nStatic = 0;
+};
+
+// Typed contexts rely on constexpr, which debug builds strip
+#ifndef SPT_DEBUG
+
+// Binds the constexpr id of a template key to the type of its value
+template<int ID, typename T> struct field
+{
+  static constexpr int id = ID;
+  using type = T;
+};
+
+// Returns one past the largest of the ids
+constexpr int ids_end(const int *pIds, size_t nIds)
+{
+  int ret = 0;
+  for(size_t i = 0; i < nIds; ++i)
+  {
+    if(pIds[i] + 1 > ret) ret = pIds[i] + 1;
+  }
+  return ret;
+}
+
+// Strongly typed template values, one field per key of the template
+// Declared from the compile time key list, for e.g.
+//   SPT_KEYS(keys, parser);
+//   using ctx_t = spt::context<SPT_FIELD(keys, "name", string), SPT_FIELD(keys, "age", int)>;
+//   REPORT_KEY_ERRORS(keys, ctx_t);
+// Since key ids are slot ids, rendering a key is an indexed call that writes the field directly
+template<typename... FIELDS> class context
+{
+public:
+  // Key ids of the fields in declaration order
+  static constexpr std::array<int, sizeof...(FIELDS)> ids{{FIELDS::id...}};
+  
+private:
+  std::tuple<typename FIELDS::type...> m_tplVals;
+  
+  static constexpr int s_nIds = spt::ids_end(ids.data(), ids.size());
+  
+  using render_fn = void (*)(sink &, const context &, const template_slots &, int, const char_view &, const value_format &);
+  
+  template<size_t I> 
+  static void render_field(sink &out, const context &ctx, const template_slots &, int, const char_view &, const value_format &fmt)
+  {
+    write_value(out, std::get<I>(ctx.m_tplVals), fmt);
+  }
+  
+  // Ids without a field are loop variables, which live in the slot table
+  static void render_loop_var(sink &out, const context &, const template_slots &slots, int iSlot, const char_view &symKey, const value_format &fmt)
+  {
+    render_slot(out, slots, iSlot, symKey, fmt);
+  }
+  
+  template<size_t... I> static constexpr std::array<render_fn, s_nIds> make_table(std::index_sequence<I...> /*unused*/)
+  {
+    std::array<render_fn, s_nIds> arr{};
+    for(auto &fn: arr) fn = &render_loop_var;
+    ((FIELDS::id >= 0 ? void(arr[FIELDS::id] = &render_field<I>) : void()), ...);
+    return arr;
+  }
+  
+  // Render function for each key id
+  static const std::array<render_fn, s_nIds> &table()
+  {
+    static constexpr std::array<render_fn, s_nIds> arr = make_table(std::index_sequence_for<FIELDS...>{});
+    return arr;
+  }
+  
+  // Position of the field for key id ID
+  template<int ID> static constexpr size_t position()
+  {
+    size_t i = 0;
+    while(i < ids.size() && ids[i] != ID) ++i;
+    return i;
+  }
+  
+public:
+  
+  static constexpr int ids_end() { return s_nIds; }
+  
+  // Field access by constexpr key id
+  template<int ID> auto &get()
+  {
+    static_assert(position<ID>() < sizeof...(FIELDS), "No field for this template key");
+    return std::get<position<ID>()>(m_tplVals);
+  }
+  
+  template<int ID> const auto &get() const
+  {
+    static_assert(position<ID>() < sizeof...(FIELDS), "No field for this template key");
+    return std::get<position<ID>()>(m_tplVals);
+  }
+  
+  // Renders the key with slot id iSlot
+  void render(sink &out, int iSlot, const template_slots &slots, const char_view &symKey, const value_format &fmt) const
+  {
+    if(iSlot < s_nIds)
     {
-      if(!m_templates.parts().empty())
-      {
-        ostr << sIndent;
-        m_templates.render(ostr, dctVals, dctFuns);
-        ostr << "\n";
-      }
-      
-      if(!bTextNode && !bCtrlNode)
-      {  
-        ostr << sIndent << "</" << m_symTag << ">" << "\n";
-      }
+      table()[iSlot](out, *this, slots, iSlot, symKey, fmt);
     }
     else
     {
-      if(!bTextNode)
-      {
-        ostr << "\n";
-      }
+      render_loop_var(out, *this, slots, iSlot, symKey, fmt);
     }
   }
-  
 };
 
+// Value table used to render with a typed context
+// Keys come from the context, loop variables and function calls use the slot table
+template<typename CTX> struct typed_vals
+{
+  const CTX &ctx;
+  template_slots slots;
+};
+
+template<typename CTX> void render_slot(sink &out, const typed_vals<CTX> &vals, int iSlot, const char_view &symKey, const value_format &fmt)
+{
+  vals.ctx.render(out, iSlot, vals.slots, symKey, fmt);
+}
+
+template<typename CTX> template_slots &loop_slots(typed_vals<CTX> &vals)
+{
+  return vals.slots;
+}
+
+template<typename CTX> struct is_slot_table<typed_vals<CTX>>: std::true_type {};
+
+#endif
+
 // Encapsulates the runtime DOM tree including templates
+// The nodes are one preorder array of rnode, built with a single allocation, and rendering walks it front to back
 class tree
 {
 private:
-  rnode m_Root;
+  // Slot ids of every template key and loop variable, assigned in document order
+  slot_dict m_dctSlots;
+  
+  // Names of the functions called, indexed by function id
+  vector<string> m_arrFunNames;
+  
+  // All the nodes in preorder, the root is the first
+  vector<rnode> m_arrNodes;
+  
+  // Text parts and serialized tags of all the nodes
+  template_text m_text;
+  
+  // Functions called in the body of each for tag, see parallel::split
+  vector<vector<string>> m_arrLoopFuns;
+  
+  // A cache tag's time to live, and without a key attribute the parts whose values make up its key
+  struct cache_info
+  {
+    int nTtl = 0;
+    bool bKey = false;
+    vector<int> arrParts;
+  };
+  vector<cache_info> m_arrCaches;
+  
+  // Where the bodies of cache tags are kept, none if null
+  // Keys start with the tree's id, so trees do not share entries unless one is a copy of the other
+  fragment_cache *m_pCache = nullptr;
+  size_t m_uId = 0;
+  
+  // Hash of the template text, see etag
+  uint64_t m_uHash = 0;
 
 public:  
-  template_vals m_dctTemplateVals;
   template_funs m_dctTemplateFuns;
   
   // Takes the compile time parser data and constructs thr runtime node tree 
-  // Also generates a map for templates 
-  tree(const parser &parser): m_Root ("root", "", false, -1)
+  // Also assigns a slot to every template key and an id to every function
+  template<typename PARSER> tree(const PARSER &parser)
   {
-    build(parser, m_Root, 0);
+    // Every parser node but attributes becomes a runtime node, plus the root
+    m_arrNodes.reserve(parser.m_arrNodes.size() + 1);
+    
+    rnode root;
+    root.kind = NK_ROOT;
+    m_arrNodes.push_back(root);
+    if(parser.m_arrNodes.size()) build(parser, 0);
+    m_arrNodes[0].iEnd = m_arrNodes.size();
+    
+    static std::atomic<size_t> s_nTrees {0};
+    m_uId = ++s_nTrees;
+    m_uHash = parser.m_uHash;
+    
+    link();
+    cache_static();
+    count_bytes(0, 0);
+  }
+  
+  // Returns an empty value table sized for this tree
+  template_slots slots() const
+  {
+    return template_slots(m_dctSlots);
+  }
+  
+  // Returns a value table filled from a dictionary of key names
+  template_slots slots(const template_vals &dctVals) const
+  {
+    template_slots ret(m_dctSlots);
+    for(const auto &i: dctVals)
+    {
+      ret[i.first] = i.second;
+    }
+    return ret;
+  }
+  
+  // Returns the key name to slot id map
+  const slot_dict &slot_ids() const
+  {
+    return m_dctSlots;
   }
   
   // Test function that returns a map of all the keys with value == key
-  template_vals get_default_dict()
+  template_vals get_default_dict() const
   {
     template_vals ret;
-    for(const auto &i: m_dctTemplateVals)
+    for(const auto &i: m_dctSlots)
     {
       ret[i.first] = i.first;
     }
     return ret;
   }
     
-  rnode root() const 
+  const rnode &root() const 
   {
-    return m_Root;
+    return m_arrNodes.front();
+  }
+  
+  // All the nodes in preorder
+  const vector<rnode> &nodes() const
+  {
+    return m_arrNodes;
+  }
+  
+  // Hash of the template text, the same for every engine built from one parser
+  uint64_t structure_hash() const
+  {
+    return m_uHash;
+  }
+  
+  // Strong ETag of the output a render with these values would produce, computed without rendering
+  // The output is a function of the template text and the values, as long as template functions only depend on their argument
+  string etag(const template_slots &slots) const
+  {
+    return format_etag(hash_slots(slots, m_uHash));
+  }
+  
+  string etag(const template_vals &dctVals) const
+  {
+    return etag(slots(dctVals));
+  }
+  
+  // Estimates the size of a render with these values and functions, to size the output up front
+  // Markup, loop counts and escaped values are exact, loop variables count as wide as their widest value
+  // Functions count their max_size, so this is an upper bound when every function called has one and leaves the values alone
+  // A function without one counts as SPT_FUN_SIZE bytes a call, which a function writing more makes come out short
+  size_t estimate_size(const template_slots &slots, const template_funs &funs = template_funs()) const
+  {
+    size_state state;
+    state.arrLoops.resize(m_dctSlots.size());
+    for(const auto &sName: m_arrFunNames)
+    {
+      const fun_entry *pFun = funs.find(sName);
+      state.arrFunSizes.push_back(pFun && pFun->max_size() ? pFun->max_size() : SPT_FUN_SIZE);
+    }
+    return estimate_size(slots, state, 0);
+  }
+  
+  size_t estimate_size(const template_vals &dctVals, const template_funs &funs = template_funs()) const
+  {
+    return estimate_size(slots(dctVals), funs);
+  }
+  
+  // Keeps the rendered bodies of cache tags in cache, which has to outlive the renders
+  // Without a cache, or when tags are nested in a way that makes them static, the bodies are rendered every time
+  void use_cache(fragment_cache &cache)
+  {
+    m_pCache = &cache;
+  }
+  
+  // Looks up the functions this tree calls, the result can be reused across renders
+  bound_funs bind(const template_funs &dctFuns) const
+  {
+    return bound_funs(dctFuns, m_arrFunNames.begin(), m_arrFunNames.end());
+  }
+  
+  // Renders the tree with values from a slot table
+  // Loop variables are set in slots while rendering and functions may store state in it
+  void render(sink &out, template_slots &slots, const bound_funs &funs) const
+  {
+    render_node(out, slots, funs, 0, 0);
+  }
+  
+  void render(sink &out, template_slots &slots, const template_funs &dctFuns) const
+  {
+    render_node(out, slots, bind(dctFuns), 0, 0);
+  }
+  
+  // Renders without touching the caller's values, loop variables and function state go into an overlay for this render
+  // The tree is never modified by rendering, so one tree can be rendered by many threads at once
+  void render(sink &out, const template_slots &slots, const template_funs &dctFuns) const
+  {
+    template_slots ctx = template_slots::overlay(slots);
+    render_node(out, ctx, bind(dctFuns), 0, 0);
+  }
+  
+  // Same as above with values from a dictionary of key names
+  void render(sink &out, const template_vals &dctVals, const template_funs &dctFuns) const
+  {
+    template_slots ctx = slots(dctVals);
+    render_node(out, ctx, bind(dctFuns), 0, 0);
+  }
+
+  // Renders the tree, splitting big loops across the threads of par
+  void render(sink &out, const template_slots &slots, const template_funs &dctFuns, const parallel &par) const
+  {
+    template_slots ctx = template_slots::overlay(slots);
+    parallel_vals<template_slots> vals{ctx, par};
+    render_node(out, vals, bind(dctFuns), 0, 0);
+  }
+
+  // Renders into an ostream through an ostream_sink
+  template<typename VALS> void render(ostream &ostr, VALS &vals, const template_funs &dctFuns) const
+  {
+    ostream_sink out(ostr);
+    render(out, vals, dctFuns);
+  }
+  
+#ifndef SPT_DEBUG
+  // Renders the tree with values from a typed context
+  // Loop variables and function calls use a slot table that lives for this render only
+  template<typename... FIELDS> void render(sink &out, const context<FIELDS...> &ctx, const template_funs &dctFuns) const
+  {
+    assert(ctx.ids_end() <= int(m_dctSlots.size()));
+    typed_vals<context<FIELDS...>> vals{ctx, slots()};
+    render_node(out, vals, bind(dctFuns), 0, 0);
+  }
+#endif
+  
+private:
+  // Writes indent levels of indentation
+  static void write_indent(sink &out, int indent)
+  {
+    static const string s_sSpaces(256, ' ');
+    for(size_t n = indent * 2; n; )
+    {
+      size_t nPart = std::min(n, s_sSpaces.size());
+      out.write(s_sSpaces.data(), nPart);
+      n -= nPart;
+    }
+  }
+  
+  // Classifies the node, control tags are matched like template_keys and fold_walker do, see basic_parser::ctrl_tag
+  template<typename PARSER> static node_kind kind_of(const PARSER &parser, const cnode &node, bool bVoidNode)
+  {
+    switch(node.iTag == TAG_TEXT ? TAG_TEXT : parser.ctrl_tag(node))
+    {
+      case TAG_TEXT:  return NK_TEXT;
+      case TAG_FOR:   return NK_FOR;
+      case TAG_IF:    return NK_IF;
+      case TAG_ROOT:  return NK_ROOT;
+      case TAG_FLUSH: return NK_FLUSH;
+      case TAG_CACHE: return NK_CACHE;
+    }
+    return bVoidNode ? NK_VOID : NK_ELEMENT;
+  }
+  
+  // Builds the runtime nodes of the parser node at index and its siblings, each subtree is appended in preorder
+  // Detects strings of the form {{key}} inside node content and assigns slots for them
+  template<typename PARSER> void build(const PARSER &parser, int index)
+  {
+    for(; index > NULL_NODE; index = parser.m_arrNodes[index].sibling)
+    {
+      // Get the node tag and content
+      const cnode &cNode = parser.m_arrNodes[index];
+      
+      rnode rNode;
+      rNode.bVoid = cNode.child == VOID_TAG;
+      rNode.kind = kind_of(parser, cNode, rNode.bVoid);
+      
+      // Split the text into plain chunks and template strings, keys in the content get slots first
+      rNode.iText = m_text.begin_range();
+      split_text(parser.text(cNode), [&](const char_view &sym, bool bIsTemplate)
+      {
+        m_text.add(sym, bIsTemplate, m_dctSlots, m_arrFunNames);
+      });
+      rNode.iTextEnd = m_text.size();
+      
+      // Elements get their tags serialized with the ID and attributes, then keys in attribute values get slots
+      // The loop variable of a for tag gets a slot before the loop body
+      // Loop bounds and if conditions were parsed and checked by the parser
+      if(rNode.kind == NK_ELEMENT || rNode.kind == NK_VOID)
+      {
+        set_markup(parser, index, rNode);
+      }
+      else if(rNode.kind == NK_FOR)
+      {
+        char_view symVar = parser.find_attr(index, "var");
+        rNode.iVarSlot = get_slot(m_dctSlots, string(symVar.begin(), symVar.end()));
+        rNode.loop = parser.for_params(index);
+      }
+      else if(rNode.kind == NK_IF)
+      {
+        rNode.bCond = parser.find_attr(index, "cond").toInt() != 0;
+      }
+      else if(rNode.kind == NK_CACHE)
+      {
+        set_cache(parser, index, rNode);
+      }
+      
+      int iNode = m_arrNodes.size();
+      m_arrNodes.push_back(rNode);
+      
+      // If there are children for this node, skipping the @ATTR node if its the first
+      if(cNode.child > NULL_NODE)
+      {
+        const auto &child = parser.m_arrNodes[cNode.child];
+        build(parser, child.iTag == TAG_ATTR ? child.sibling : cNode.child);
+      }
+      m_arrNodes[iNode].iEnd = m_arrNodes.size();
+    }
   }
   
-  // Recursively builds the runtime tree structure from the compile time parser
-  // Detects strings of the form {{key}} inside node content and adds it to a template_dict
-  static void build(const parser &parser, rnode &parent, int index)
+  // Serializes the open and close tags of the element at index, attributes are in source order like fold_walker::attrs
+  template<typename PARSER> void set_markup(const PARSER &parser, int index, rnode &rNode)
   {
-    // Get the node tag and content
     const cnode &cNode = parser.m_arrNodes[index];
+    auto add_text = [&](const char_view &sym)
+    {
+      m_text.add(sym, false, m_dctSlots, m_arrFunNames);
+    };
     
-    // Create a SPTNode and set ID if any
-    rnode rNode(cNode.tag, cNode.text, cNode.child == VOID_TAG, index);
-    if(!cNode.id.empty())
+    rNode.iOpen = m_text.begin_range();
+    add_text("<");
+    char_view symTag = parser.tag(cNode), symId = parser.id(cNode);
+    add_text(symTag);
+    if(!symId.empty())
     {
-      rNode.m_symId = cNode.id;
+      add_text(" ID='");
+      add_text(symId);
+      add_text("'");
     }
     
-    // Place this node as a child of the parent
-    parent.m_arrChildren.emplace_back(rNode);
+    parser.for_each_attr(index, [&](const char_view &symName, const char_view &symValue)
+    {
+      string sName(symName.begin(), symName.end());
+      std::transform(sName.begin(), sName.end(), sName.begin(), to_lower);
+      add_text(" ");
+      add_text(char_view(sName.data(), sName.data() + sName.size()));
+      add_text("='");
+      split_text(symValue, [&](const char_view &sym, bool bIsTemplate)
+      {
+        m_text.add(sym, bIsTemplate, m_dctSlots, m_arrFunNames, HC_ATTR);
+      });
+      add_text("'");
+    });
+    add_text(">");
+    rNode.iOpenEnd = m_text.size();
+    
+    string sClose = "</";
+    sClose.append(symTag.begin(), symTag.end());
+    sClose += ">\n";
+    rNode.iClose = m_text.add_text(sClose.data(), sClose.size());
+    rNode.nClose = sClose.size();
+  }
+  
+  // Adds the parts of the key of the cache tag at index, they get slots like the keys in attribute values
+  template<typename PARSER> void set_cache(const PARSER &parser, int index, rnode &rNode)
+  {
+    cache_info info;
+    char_view symTtl = parser.find_attr(index, "ttl");
+    info.nTtl = symTtl.empty() ? 0 : symTtl.toInt();
+    
+    char_view symKey = parser.find_attr(index, "key");
+    info.bKey = !symKey.empty();
+    rNode.iOpen = m_text.begin_range();
+    split_text(symKey, [&](const char_view &sym, bool bIsTemplate)
+    {
+      m_text.add(sym, bIsTemplate, m_dctSlots, m_arrFunNames);
+    });
+    rNode.iOpenEnd = m_text.size();
     
-    // If there are children for this node
-    if(cNode.child > NULL_NODE)
+    rNode.iCache = m_arrCaches.size();
+    m_arrCaches.push_back(std::move(info));
+  }
+  
+  // Lists the functions called in the body of each for tag once the tree is built
+  void link()
+  {
+    const auto &arrParts = m_text.parts();
+    for(auto &node: m_arrNodes)
     {
-      // Check if first child is "@ATTR"
-      const auto &child = parser.m_arrNodes[cNode.child];
-      if(child.tag == g_symAttr)
+      if(node.kind != NK_FOR) continue;
+      
+      vector<string> arrFuns;
+      for(int i = &node - m_arrNodes.data() + 1; i < node.iEnd; ++i)
       {
-        // Put the chain of attribute nodes into ther attrs array
-        auto attr = parser.m_arrNodes[child.child];
-        while(true)
+        const rnode &child = m_arrNodes[i];
+        for(auto range: {std::make_pair(child.iOpen, child.iOpenEnd), std::make_pair(child.iText, child.iTextEnd)})
         {
-          parent.m_arrChildren.back().m_dctAttrs[attr.getTag()] = attr.getText();
-          if(attr.sibling == NULL_NODE) break;
-          attr = parser.m_arrNodes[attr.sibling];
+          for(int iPart = range.first; iPart < range.second; ++iPart)
+          {
+            int iFun = arrParts[iPart].iFun;
+            if(iFun != NULL_NODE && std::find(arrFuns.begin(), arrFuns.end(), m_arrFunNames[iFun]) == arrFuns.end())
+            {
+              arrFuns.push_back(m_arrFunNames[iFun]);
+            }
+          }
         }
+      }
+      
+      node.iLoopFuns = m_arrLoopFuns.size();
+      m_arrLoopFuns.push_back(std::move(arrFuns));
+    }
+    
+    // A cache tag without a key is keyed on the values of the keys in its body, and the params of the functions it calls
+    // Loop variables of for tags in the body are set by the body, so they are left out
+    for(auto &node: m_arrNodes)
+    {
+      if(node.kind != NK_CACHE || m_arrCaches[node.iCache].bKey) continue;
+      
+      vector<int> &arrParts = m_arrCaches[node.iCache].arrParts;
+      vector<int> arrSlots;
+      for(int i = &node - m_arrNodes.data() + 1; i < node.iEnd; ++i)
+      {
+        if(m_arrNodes[i].kind == NK_FOR) arrSlots.push_back(m_arrNodes[i].iVarSlot);
+      }
+      
+      for(int i = &node - m_arrNodes.data() + 1; i < node.iEnd; ++i)
+      {
+        const rnode &child = m_arrNodes[i];
+        for(auto range: {std::make_pair(child.iOpen, child.iOpenEnd), std::make_pair(child.iText, child.iTextEnd)})
+        {
+          for(int iPart = range.first; iPart < range.second; ++iPart)
+          {
+            const auto &part = m_text.parts()[iPart];
+            int iSlot = part.iFun != NULL_NODE ? part.arg.iSlot : part.iSlot;
+            if(iSlot != NULL_NODE && std::find(arrSlots.begin(), arrSlots.end(), iSlot) == arrSlots.end())
+            {
+              arrSlots.push_back(iSlot);
+              arrParts.push_back(iPart);
+            }
+          }
+        }
+      }
+    }
+  }
+  
+  // Renders each subtree that has no keys, function calls, loops or flushes once, render writes its bytes as they are
+  // Indentation only depends on the depth, so a static subtree renders the same every time
+  void cache_static()
+  {
+    // The children of a node come after it, so walking backwards sees them first
+    vector<bool> arrStatic(m_arrNodes.size());
+    for(int i = int(m_arrNodes.size()) - 1; i >= 0; --i)
+    {
+      const rnode &node = m_arrNodes[i];
+      bool bStatic = node.kind != NK_FOR && node.kind != NK_FLUSH &&
+        !m_text.has_template(node.iOpen, node.iOpenEnd) && !m_text.has_template(node.iText, node.iTextEnd);
+      
+      for(int iChild = i + 1; bStatic && iChild < node.iEnd; iChild = m_arrNodes[iChild].iEnd)
+      {
+        bStatic = arrStatic[iChild];
+      }
+      arrStatic[i] = bStatic;
+    }
+    
+    cache_static(arrStatic, 0, 0);
+  }
+  
+  // Renders the outermost static subtrees under the node at index, which is at the given indent
+  void cache_static(const vector<bool> &arrStatic, int index, int indent)
+  {
+    if(arrStatic[index])
+    {
+      string_sink out;
+      template_slots slots = this->slots();
+      render_node(out, slots, bound_funs(), index, indent);
+      
+      m_arrNodes[index].iStatic = m_text.add_text(out.data(), out.size());
+      m_arrNodes[index].nStatic = out.size();
+      return;
+    }
+    
+    // Only elements indent their children
+    const rnode &node = m_arrNodes[index];
+    int iChildIndent = node.kind == NK_ELEMENT ? indent + 1 : indent;
+    for(int i = index + 1; i < node.iEnd; i = m_arrNodes[i].iEnd)
+    {
+      cache_static(arrStatic, i, iChildIndent);
+    }
+  }
+  
+  // Sets the bytes each node writes itself, in the same order render_node writes them
+  void count_bytes(int index, int indent)
+  {
+    rnode &node = m_arrNodes[index];
+    int nIndent = indent * 2;
+    int iChildIndent = indent;
+    
+    size_t n = 0;
+    if(node.kind == NK_ELEMENT || node.kind == NK_VOID)
+    {
+      n += nIndent + m_text.text_size(node.iOpen, node.iOpenEnd);
+      if(node.iEnd > index + 1) n += 1;
+      iChildIndent = indent + 1;
+    }
+    
+    if(!node.bVoid)
+    {
+      if(node.iTextEnd > node.iText) n += nIndent + m_text.text_size(node.iText, node.iTextEnd) + 1;
+      if(node.kind == NK_ELEMENT) n += nIndent + node.nClose;
+    }
+    else if(node.kind != NK_TEXT && node.kind != NK_FLUSH)
+    {
+      n += 1;
+    }
+    node.nBytes = n;
+    
+    for(int i = index + 1; i < node.iEnd; i = m_arrNodes[i].iEnd)
+    {
+      count_bytes(i, iChildIndent);
+    }
+  }
+  
+  // What estimate_size carries down the tree
+  struct size_state
+  {
+    // The for tag whose variable a slot is, by slot, null outside its loop
+    vector<const rnode *> arrLoops;
+    
+    // max_size of the functions by id, SPT_FUN_SIZE for those without one
+    vector<size_t> arrFunSizes;
+  };
+  
+  // Length of a number as rendered with a format
+  template<typename T> static size_t num_size(const T &val, const value_format &fmt)
+  {
+    char szNum[value_format::MAX_CHARS];
+    span_sink out(szNum, sizeof(szNum));
+    write_value(out, val, fmt);
+    return out.size();
+  }
+  
+  // Length of the value of a key part as rendered, strings once escaped
+  static size_t value_size(const template_slots &slots, const template_text::part &part)
+  {
+    const template_val &val = slots.at(part.iSlot);
+    if(auto pStr = std::get_if<string>(&val)) return escaped_size(pStr->data(), pStr->size(), part.fmt.ctx);
+    if(auto pRaw = std::get_if<raw_html>(&val)) return pRaw->html.size();
+    if(auto pInt = std::get_if<int>(&val)) return num_size(*pInt, part.fmt);
+    return num_size(std::get<float>(val), part.fmt);
+  }
+  
+  // Sum of the sizes of the keys and function calls in the parts [iBeg, iEnd)
+  // A loop variable is as wide as the wider of its first and last value, numbers get wider away from 0
+  size_t keys_size(const template_slots &slots, const size_state &state, int iBeg, int iEnd) const
+  {
+    size_t n = 0;
+    for(int i = iBeg; i < iEnd; ++i)
+    {
+      const auto &part = m_text.parts()[i];
+      if(part.iFun != NULL_NODE)
+      {
+        n += state.arrFunSizes[part.iFun];
+      }
+      else if(part.iSlot == NULL_NODE)
+      {
+        continue;
+      }
+      else if(const rnode *pFor = state.arrLoops[part.iSlot])
+      {
+        int iLast = pFor->loop.iFrom + (pFor->loop.count() - 1) * pFor->loop.iInc;
+        n += std::max(num_size(pFor->loop.iFrom, part.fmt), num_size(iLast, part.fmt));
+      }
+      else if(slots.bound(part.iSlot))
+      {
+        n += value_size(slots, part);
+      }
+    }
+    return n;
+  }
+  
+  // Estimates the size of the subtree at index
+  size_t estimate_size(const template_slots &slots, size_state &state, int index) const
+  {
+    const rnode &node = m_arrNodes[index];
+    if(node.iStatic != NULL_NODE) return node.nStatic;
+    
+    // The open parts of a cache tag are its key, which is not written
+    size_t n = node.nBytes + keys_size(slots, state, node.iText, node.iTextEnd);
+    if(node.kind == NK_ELEMENT || node.kind == NK_VOID)
+    {
+      n += keys_size(slots, state, node.iOpen, node.iOpenEnd);
+    }
+    
+    if(node.kind == NK_IF && !node.bCond) return n;
+    
+    const rnode *pForSaved = nullptr;
+    if(node.kind == NK_FOR)
+    {
+      pForSaved = state.arrLoops[node.iVarSlot];
+      state.arrLoops[node.iVarSlot] = &node;
+    }
+    
+    size_t nChildren = 0;
+    for(int i = index + 1; i < node.iEnd; i = m_arrNodes[i].iEnd)
+    {
+      nChildren += estimate_size(slots, state, i);
+    }
+    
+    if(node.kind == NK_FOR)
+    {
+      nChildren *= node.loop.count();
+      state.arrLoops[node.iVarSlot] = pForSaved;
+    }
+    return n + nChildren;
+  }
+  
+  // Render the children of the node at index, stepping from each child to the next sibling past its subtree
+  template<typename VALS> void render_children(sink &out, VALS &vals, const bound_funs &funs, int index, int indent) const
+  {
+    const rnode *pNodes = m_arrNodes.data();
+    for(int i = index + 1, iEnd = pNodes[index].iEnd; i < iEnd; i = pNodes[i].iEnd)
+    {
+      render_node(out, vals, funs, i, indent);
+    }
+  }
+  
+  // Returns the key a cache tag's body is kept under
+  // Values are prefixed with their length, so different values cannot run together into the same key
+  template<typename VALS> string cache_key(VALS &vals, const bound_funs &funs, int index) const
+  {
+    const rnode &node = m_arrNodes[index];
+    const cache_info &info = m_arrCaches[node.iCache];
+    string sKey = std::to_string(m_uId) + ':' + std::to_string(index) + ':';
+    
+    string_sink val;
+    if(info.bKey)
+    {
+      m_text.render(val, vals, funs, node.iOpen, node.iOpenEnd);
+      sKey.append(val.data(), val.size());
+      return sKey;
+    }
+    
+    template_slots &slots = loop_slots(vals);
+    for(int iPart: info.arrParts)
+    {
+      const auto &part = m_text.parts()[iPart];
+      val.clear();
+      if(part.iFun == NULL_NODE)
+      {
+        render_slot(val, vals, part.iSlot, part.sym, part.fmt);
+      }
+      else if(slots.bound(part.arg.iSlot))
+      {
+        render_slot(val, slots, part.arg.iSlot, part.sym, value_format{});
+      }
+      else // A function param with no value
+      {
+        sKey += '-';
+        continue;
+      }
+      
+      sKey += std::to_string(val.size()) + ':';
+      sKey.append(val.data(), val.size());
+    }
+    return sKey;
+  }
+  
+  // Writes the body of a cache tag from the cache, rendering and caching it on a miss
+  // A <flush> in the body only flushes when the body is rendered
+  template<typename VALS> void render_cache(sink &out, VALS &vals, const bound_funs &funs, int index, int indent) const
+  {
+    if(!m_pCache)
+    {
+      render_children(out, vals, funs, index, indent);
+      return;
+    }
+    
+    string sKey = cache_key(vals, funs, index);
+    auto pBytes = m_pCache->find(sKey);
+    if(!pBytes)
+    {
+      string_sink body;
+      render_children(body, vals, funs, index, indent);
+      pBytes = m_pCache->insert(sKey, body.take(), m_arrCaches[m_arrNodes[index].iCache].nTtl);
+    }
+    out.write(pBytes->data(), pBytes->size());
+  }
+  
+  // Render the children in a for tag
+  template<typename VALS> void render_for(sink &out, VALS &vals, const bound_funs &funs, int index, int indent) const
+  {
+    const rnode &node = m_arrNodes[index];
+    const parallel *pPar = parallel_of(vals);
+    if(pPar && pPar->split(node.loop.count(), m_arrLoopFuns[node.iLoopFuns]))
+    {
+      render_for_parallel(out, inner_vals(vals), funs, index, indent, pPar->pool());
+      return;
+    }
+    
+    template_slots &slots = loop_slots(vals);
+    
+    run_loop(slots, node.iVarSlot, node.loop, [&]
+    {
+      render_children(out, vals, funs, index, indent);
+    });
+  }
+  
+  // Renders chunks of the iterations on a thread pool, each into its own buffer with its own values from chunk_vals
+  // The buffers are written out in order, so the output is the same as rendering sequentially
+  // A <flush> in the body flushes out at the same place in the output, once the whole loop is rendered
+  template<typename VALS> void render_for_parallel(sink &out, VALS &vals, const bound_funs &funs, int index, int indent, thread_pool &pool) const
+  {
+    const rnode &node = m_arrNodes[index];
+    int nIters = node.loop.count();
+    int nChunks = std::min(nIters, pool.size() * 4);
+    vector<flush_marking_sink> arrOut(nChunks);
+    vector<std::exception_ptr> arrErr(nChunks);
+    
+    pool.run(nChunks, [&](int iChunk)
+    {
+      try
+      {
+        VALS valsChunk = chunk_vals(vals);
+        loop_var var(loop_slots(valsChunk), node.iVarSlot);
         
-        // If there were more nodes after @ATTR, recursively process them
-        if(child.sibling > NULL_NODE)
+        int iEnd = (long long)(iChunk + 1) * nIters / nChunks;
+        for(int i = (long long)iChunk * nIters / nChunks; i < iEnd; ++i)
         {
-          build(parser, parent.m_arrChildren.back(), child.sibling);
+          var.set(node.loop.iFrom + i * node.loop.iInc);
+          render_children(arrOut[iChunk], valsChunk, funs, index, indent);
         }
       }
-      else // No @ATTR
+      catch(...)
       {
-        // Process children 
-        build(parser, parent.m_arrChildren.back(), cNode.child);
+        arrErr[iChunk] = std::current_exception();
       }
+    });
+    
+    for(int i = 0; i < nChunks; ++i)
+    {
+      if(arrErr[i]) std::rethrow_exception(arrErr[i]);
+      arrOut[i].write_to(out);
+    }
+  }
+  
+  // Renders the node at index and its subtree
+  // VALS is either a template_slots table or a typed context (see render)
+  template<typename VALS> void render_node(sink &out, VALS &vals, const bound_funs &funs, int index, int indent) const
+  {
+    const rnode &node = m_arrNodes[index];
+    if(node.iStatic != NULL_NODE)
+    {
+      m_text.write_text(out, node.iStatic, node.nStatic);
+      return;
+    }
+    
+    switch(node.kind)
+    {
+      case NK_ELEMENT:
+      case NK_VOID:
+        // Render the open tag with the ID and attributes
+        write_indent(out, indent);
+        m_text.render(out, vals, funs, node.iOpen, node.iOpenEnd);
+        
+        // If tag has children add a newline
+        if(node.iEnd > index + 1) 
+        {
+          out << '\n';
+          
+          // Render children if any
+          render_children(out, vals, funs, index, indent + 1);
+        }
+        break;
+      
+      // control tags, do not indent
+      case NK_IF:
+        if(node.bCond)
+        {
+          render_children(out, vals, funs, index, indent);
+        }
+        break;
+        
+      case NK_FOR:
+        render_for(out, vals, funs, index, indent);
+        break;
+        
+      case NK_ROOT:
+        render_children(out, vals, funs, index, indent);
+        break;
+        
+      case NK_FLUSH:
+        out.flush();
+        break;
+        
+      case NK_CACHE:
+        render_cache(out, vals, funs, index, indent);
+        break;
+        
+      case NK_TEXT:
+        break;
     }
     
-    // Process siblings
-    if(cNode.sibling > NULL_NODE)
+    // Skip text and close tag for void tags and control tags
+    if(!node.bVoid)
+    {
+      if(node.iTextEnd > node.iText)
+      {
+        write_indent(out, indent);
+        m_text.render(out, vals, funs, node.iText, node.iTextEnd);
+        out << "\n";
+      }
+      
+      if(node.kind == NK_ELEMENT)
+      {  
+        write_indent(out, indent);
+        m_text.write_text(out, node.iClose, node.nClose);
+      }
+    }
+    else
     {
-      build(parser, parent, cNode.sibling);
+      if(node.kind != NK_TEXT && node.kind != NK_FLUSH)
+      {
+        out << "\n";
+      }
     }
   }
 };
 
 } // namespace spt
 
+// Constexpr id of a template key, use with keys declared by SPT_KEYS
+#define SPT_KEY(keys, name) (keys).index(name)
+
+// Declares a field of a typed context for a template key
+#define SPT_FIELD(keys, name, T) spt::field<SPT_KEY(keys, name), T>
+
+#ifndef SPT_DEBUG
+
+// Raises a compile error if a context field names a key that the template does not use
+// or if a template key (other than loop variables and function params) has no field, at the row and column of the key
+// A template with more keys than keys holds is reported as Template_too_large where the first one that did not fit is
+#define REPORT_KEY_ERRORS(keys, CTX)                                                                   \
+{                                                                                                      \
+  constexpr int iTooLargeRow = (keys).too_large() ? (keys).overflow_row() : -1;                        \
+  constexpr int iTooLargeCol = (keys).too_large() ? (keys).overflow_col() : -1;                        \
+  spt::IF<(keys).too_large(), spt::Error<iTooLargeRow, iTooLargeCol, spt::Template_too_large>> {};     \
+  constexpr bool bUnknownKey = (keys).find_unknown(CTX::ids.data(), CTX::ids.size()) > -1;            \
+  spt::IF<bUnknownKey, spt::Error<-1, -1, spt::Unknown_template_key>> {};                              \
+  constexpr int iMissing = (keys).find_missing(CTX::ids.data(), CTX::ids.size());                     \
+  constexpr int iMissingRow = iMissing > -1 ? (keys).row(iMissing) : -1;                                \
+  constexpr int iMissingCol = iMissing > -1 ? (keys).col(iMissing) : -1;                                \
+  spt::IF<(iMissing > -1), spt::Error<iMissingRow, iMissingCol, spt::Missing_value_for_template_key>> {}; \
+}
+
+// Declares NAME as the template_keys of parser, sized for the template text so it has no key limit
+#define SPT_KEYS(NAME, parser)                                                                        \
+constexpr spt::parse_capacity NAME##_capacity((parser).start());                                      \
+constexpr spt::template_keys<NAME##_capacity.nKeys, NAME##_capacity.nFuns> NAME(parser)
+
+#else
+
+#define REPORT_KEY_ERRORS(keys, CTX)
+#define SPT_KEYS(NAME, parser) spt::template_keys<> NAME(parser)
+
+#endif
+
 constexpr spt::parser operator"" _html(const char *pszText, size_t /*unused*/)
 {
-  spt::parser parser(pszText);
-  parser.parse_html(spt::NULL_NODE);
-  return parser;
+  return spt::parse<SPT_MAX_NODES, SPT_MAX_IDS>(pszText);
 }
 
+// Declares NAME as a parser sized for the template text, which has no node limit
+// The text is scanned for upper bounds, parsed, then compacted to exactly the nodes and IDs it has
+// C++17 needs the sizes as template arguments, hence the separate passes
+#define SPT_PARSE(NAME, text)                                                                     \
+constexpr spt::parse_capacity NAME##_capacity(text);                                              \
+constexpr auto NAME##_full = spt::parse<NAME##_capacity.nNodes, NAME##_capacity.nIds>(text);      \
+constexpr auto NAME = NAME##_full.compact<NAME##_full.m_arrNodes.size(), NAME##_full.m_ids.m_arrSyms.size()>()
+
+#include "fold.h"
+#include "program.h"
+#include "loader.h"
+
 
 
 
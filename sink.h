@@ -0,0 +1,571 @@
+#ifndef SEEPHIT_SINK_H
+#define SEEPHIT_SINK_H
+
+#include "pch.h"
+
+namespace spt
+{
+
+// Where in the markup a template value is written, decides which characters are escaped
+enum html_ctx : unsigned char
+{
+  // Element content, & < and > are escaped
+  HC_TEXT,
+  
+  // Attribute value, quotes are escaped too
+  HC_ATTR
+};
+
+// How a template value is written, decided when the template is built
+// Numbers can have a format spec written like {{price:.2f}}, strings are escaped for the context of the key
+struct value_format
+{
+  // Longest output, fixed notation of the biggest double with the most digits
+  static const size_t MAX_CHARS = 384;
+  static const int MAX_PREC = 40;
+  
+  // 'f' fixed, 'e' scientific, 'g' general or 0 for the default
+  char cType = 0;
+  
+  // Digits after the point, significant digits for 'g', -1 for the default of 6
+  int nPrec = -1;
+  
+  html_ctx ctx = HC_TEXT;
+  
+  // Whether there is a numeric spec
+  constexpr bool is_num() const { return cType || nPrec >= 0; }
+};
+
+// Output target for rendering
+// Writes go into a buffer inline, only when it is full the sink's overflow() is called
+// So unlike ostream there is no virtual call, sentry or locale work per write
+class sink
+{
+protected:
+  char *m_pCur = nullptr;
+  char *m_pEnd = nullptr;
+
+  // Called with data that does not fit in [m_pCur, m_pEnd), must consume all of it
+  virtual void overflow(const char *p, size_t n) = 0;
+
+  // Formats a number with fnFormat, a to_chars call, straight into the buffer
+  // If the buffer is too short it is formatted on the stack and written, N bounds the length
+  template<size_t N, typename F> void write_chars(F fnFormat)
+  {
+    std::to_chars_result res = fnFormat(m_pCur, m_pEnd);
+    if(res.ec == std::errc())
+    {
+      m_pCur = res.ptr;
+    }
+    else
+    {
+      char sz[N];
+      write(sz, fnFormat(sz, sz + N).ptr - sz);
+    }
+  }
+
+public:
+  sink() = default;
+  sink(const sink &) = delete;
+  sink &operator=(const sink &) = delete;
+  virtual ~sink() = default;
+
+  void write(const char *p, size_t n)
+  {
+    if(n <= size_t(m_pEnd - m_pCur))
+    {
+      memcpy(m_pCur, p, n);
+      m_pCur += n;
+    }
+    else
+    {
+      overflow(p, n);
+    }
+  }
+
+  void put(char ch)
+  {
+    if(m_pCur != m_pEnd)
+    {
+      *m_pCur++ = ch;
+    }
+    else
+    {
+      overflow(&ch, 1);
+    }
+  }
+
+  // Writes text owned by the template, which stays valid for as long as the template does
+  // Sinks that can point at the text instead of copying it override this
+  virtual void write_static(const char *p, size_t n)
+  {
+    write(p, n);
+  }
+
+  // Pushes any buffered data to the target
+  virtual void flush() {}
+
+  sink &operator<<(char ch)              { put(ch); return *this; }
+  sink &operator<<(const char *psz)      { write(psz, strlen(psz)); return *this; }
+  sink &operator<<(const string &s)      { write(s.data(), s.size()); return *this; }
+
+  sink &operator<<(int i)
+  {
+    write_chars<16>([i](char *p, char *pEnd) { return std::to_chars(p, pEnd, i); });
+    return *this;
+  }
+
+  sink &operator<<(long long i)
+  {
+    write_chars<24>([i](char *p, char *pEnd) { return std::to_chars(p, pEnd, i); });
+    return *this;
+  }
+
+  // Same as the default ostream formatting, %g with 6 digits
+  sink &operator<<(double d)
+  {
+    write_chars<32>([d](char *p, char *pEnd) { return std::to_chars(p, pEnd, d, std::chars_format::general, 6); });
+    return *this;
+  }
+
+  sink &operator<<(float f)
+  {
+    return *this << double(f);
+  }
+
+  // Writes a number with a format spec from the template
+  void write_num(double d, const value_format &fmt)
+  {
+    std::chars_format fmtChars = fmt.cType == 'f' ? std::chars_format::fixed :
+                                 fmt.cType == 'e' ? std::chars_format::scientific : std::chars_format::general;
+    int nPrec = fmt.nPrec < 0 ? 6 : fmt.nPrec;
+    write_chars<value_format::MAX_CHARS>([&](char *p, char *pEnd) { return std::to_chars(p, pEnd, d, fmtChars, nPrec); });
+  }
+};
+
+// Renders into a growable string
+class string_sink: public sink
+{
+  string m_sBuf;
+
+  void grow(size_t n)
+  {
+    size_t nUsed = size();
+    m_sBuf.resize(std::max(m_sBuf.size() * 2, nUsed + n));
+    m_pCur = &m_sBuf[0] + nUsed;
+    m_pEnd = &m_sBuf[0] + m_sBuf.size();
+  }
+
+  void overflow(const char *p, size_t n) override
+  {
+    grow(n);
+    memcpy(m_pCur, p, n);
+    m_pCur += n;
+  }
+
+public:
+  explicit string_sink(size_t nReserve = 256)
+  {
+    grow(nReserve);
+  }
+
+  // Makes room for n more bytes
+  void reserve(size_t n)
+  {
+    if(size_t(m_pEnd - m_pCur) < n) grow(n);
+  }
+
+  size_t size() const             { return m_sBuf.empty() ? 0 : m_pCur - m_sBuf.data(); }
+  size_t capacity() const         { return m_sBuf.size(); }
+  const char *data() const        { return m_sBuf.data(); }
+  string str() const              { return string(data(), size()); }
+  void clear()                    { m_pCur = &m_sBuf[0]; }
+
+  // Moves the rendered text out, the sink is empty afterwards
+  string take()
+  {
+    m_sBuf.resize(size());
+    string ret = std::move(m_sBuf);
+    m_sBuf.clear();
+    grow(256);
+    return ret;
+  }
+};
+
+// String sink that records where it was flushed, so its output can be passed on with the flushes in the same places
+// The chunks of a parallel loop render into these, see tree::render_for_parallel
+class flush_marking_sink: public string_sink
+{
+  vector<size_t> m_arrFlushes;
+
+public:
+  using string_sink::string_sink;
+
+  void flush() override
+  {
+    m_arrFlushes.push_back(size());
+  }
+
+  // Writes the output to out, flushing out where this sink was flushed
+  void write_to(sink &out) const
+  {
+    size_t iPos = 0;
+    for(size_t iFlush: m_arrFlushes)
+    {
+      out.write(data() + iPos, iFlush - iPos);
+      out.flush();
+      iPos = iFlush;
+    }
+    out.write(data() + iPos, size() - iPos);
+  }
+};
+
+// Renders into a caller provided buffer
+// Output that does not fit is dropped and overflowed() is set
+class span_sink: public sink
+{
+  char *m_pBeg;
+  bool m_bOverflow = false;
+
+  void overflow(const char *p, size_t n) override
+  {
+    size_t nFit = m_pEnd - m_pCur;
+    memcpy(m_pCur, p, std::min(n, nFit));
+    m_pCur += std::min(n, nFit);
+    m_bOverflow = true;
+  }
+
+public:
+  span_sink(char *pBuf, size_t nBuf): m_pBeg(pBuf)
+  {
+    m_pCur = pBuf;
+    m_pEnd = pBuf + nBuf;
+  }
+
+  // Bytes written so far
+  size_t size() const             { return m_pCur - m_pBeg; }
+  bool overflowed() const         { return m_bOverflow; }
+};
+
+// Buffered writer to a POSIX file descriptor, flushed when full and on destruction
+class fd_sink: public sink
+{
+  int m_fd;
+  vector<char> m_arrBuf;
+  bool m_bGood = true;
+
+  // Writes all of [p, p + n), retrying on short writes and EINTR
+  void write_fd(const char *p, size_t n)
+  {
+    while(n && m_bGood)
+    {
+      ssize_t nDone = ::write(m_fd, p, n);
+      if(nDone < 0)
+      {
+        if(errno == EINTR) continue;
+        m_bGood = false;
+        break;
+      }
+      p += nDone;
+      n -= nDone;
+    }
+  }
+
+  void overflow(const char *p, size_t n) override
+  {
+    flush();
+
+    // Big writes go straight to the fd
+    if(n >= m_arrBuf.size())
+    {
+      write_fd(p, n);
+    }
+    else
+    {
+      memcpy(m_pCur, p, n);
+      m_pCur += n;
+    }
+  }
+
+public:
+  explicit fd_sink(int fd, size_t nBuf = 65536): m_fd(fd), m_arrBuf(nBuf)
+  {
+    m_pCur = m_arrBuf.data();
+    m_pEnd = m_arrBuf.data() + m_arrBuf.size();
+  }
+
+  ~fd_sink() override
+  {
+    flush();
+  }
+
+  void flush() override
+  {
+    write_fd(m_arrBuf.data(), m_pCur - m_arrBuf.data());
+    m_pCur = m_arrBuf.data();
+  }
+
+  // False if a write to the fd failed
+  bool good() const               { return m_bGood; }
+};
+
+// Streams the output in chunks to a callback, a chunk is passed on once nChunk bytes are buffered or on flush()
+// A <flush> tag in the template flushes the sink, so markup before it can be sent before the rest is rendered
+class chunked_sink: public sink
+{
+public:
+  using chunk_fn = function<void(const char *p, size_t n)>;
+
+private:
+  chunk_fn m_fnChunk;
+  vector<char> m_arrBuf;
+
+  void overflow(const char *p, size_t n) override
+  {
+    // Fill the chunk and pass it on
+    size_t nFit = m_pEnd - m_pCur;
+    memcpy(m_pCur, p, nFit);
+    m_pCur += nFit;
+    flush();
+
+    // Big writes go straight through
+    p += nFit;
+    n -= nFit;
+    if(n >= m_arrBuf.size())
+    {
+      m_fnChunk(p, n);
+    }
+    else
+    {
+      memcpy(m_pCur, p, n);
+      m_pCur += n;
+    }
+  }
+
+public:
+  chunked_sink(size_t nChunk, chunk_fn fnChunk): m_fnChunk(std::move(fnChunk)), m_arrBuf(nChunk)
+  {
+    m_pCur = m_arrBuf.data();
+    m_pEnd = m_arrBuf.data() + m_arrBuf.size();
+  }
+
+  ~chunked_sink() override
+  {
+    flush();
+  }
+
+  void flush() override
+  {
+    if(m_pCur != m_arrBuf.data()) m_fnChunk(m_arrBuf.data(), m_pCur - m_arrBuf.data());
+    m_pCur = m_arrBuf.data();
+  }
+};
+
+// Adapter for rendering into an ostream, written to it when full and on destruction, and flushed at each <flush>
+class ostream_sink: public sink
+{
+  ostream &m_ostr;
+  char m_szBuf[4096];
+
+  // Hands the buffer to the stream, which may still hold it in its own buffer
+  void write_buf()
+  {
+    m_ostr.write(m_szBuf, m_pCur - m_szBuf);
+    m_pCur = m_szBuf;
+  }
+
+  void overflow(const char *p, size_t n) override
+  {
+    write_buf();
+    if(n >= sizeof(m_szBuf))
+    {
+      m_ostr.write(p, n);
+    }
+    else
+    {
+      memcpy(m_pCur, p, n);
+      m_pCur += n;
+    }
+  }
+
+public:
+  explicit ostream_sink(ostream &ostr): m_ostr(ostr)
+  {
+    m_pCur = m_szBuf;
+    m_pEnd = m_szBuf + sizeof(m_szBuf);
+  }
+
+  ~ostream_sink() override
+  {
+    write_buf();
+  }
+
+  // A <flush> tag, the output so far is written and the stream flushed so it reaches the client
+  void flush() override
+  {
+    write_buf();
+    m_ostr.flush();
+  }
+};
+
+// Scatter/gather sink which collects the output as a list of iovecs for writev
+// Static template text is referenced in place, only dynamic values are copied into a scratch arena
+// The iovecs are valid as long as the sink and the rendered template are alive and unchanged
+class iovec_sink: public sink
+{
+  // Static text shorter than this is copied, an iovec for it would cost more than the copy
+  static const size_t MIN_REF = 32;
+
+  vector<iovec> m_arrIov;
+
+  // Scratch arena, blocks are never moved so iovecs into them stay valid
+  // All blocks have m_nBlock bytes and are reused after clear(), a write that needs more gets its own in m_arrLarge, which clear() frees
+  vector<std::unique_ptr<char[]>> m_arrBlocks;
+  vector<std::unique_ptr<char[]>> m_arrLarge;
+  size_t m_iBlock = 0;
+  size_t m_nBlock;
+
+  // Start of the scratch bytes not yet in m_arrIov
+  char *m_pPending = nullptr;
+
+  void add(const char *p, size_t n)
+  {
+    if(!m_arrIov.empty())
+    {
+      iovec &last = m_arrIov.back();
+      if((const char *)last.iov_base + last.iov_len == p)
+      {
+        last.iov_len += n;
+        return;
+      }
+    }
+    m_arrIov.push_back(iovec{const_cast<char *>(p), n});
+  }
+
+  // Moves pending scratch bytes into an iovec
+  void close_pending()
+  {
+    if(m_pCur != m_pPending) add(m_pPending, m_pCur - m_pPending);
+    m_pPending = m_pCur;
+  }
+
+  // Switches to the next scratch block, allocating one only when every block is in use
+  void next_block()
+  {
+    close_pending();
+    if(++m_iBlock == m_arrBlocks.size()) m_arrBlocks.emplace_back(new char[m_nBlock]);
+
+    m_pCur = m_pPending = m_arrBlocks[m_iBlock].get();
+    m_pEnd = m_pCur + m_nBlock;
+  }
+
+  void overflow(const char *p, size_t n) override
+  {
+    if(n > m_nBlock)
+    {
+      // Copied into a block of its own, the current block keeps taking the writes after it
+      close_pending();
+      m_arrLarge.emplace_back(new char[n]);
+      memcpy(m_arrLarge.back().get(), p, n);
+      add(m_arrLarge.back().get(), n);
+      return;
+    }
+
+    next_block();
+    memcpy(m_pCur, p, n);
+    m_pCur += n;
+  }
+
+public:
+  explicit iovec_sink(size_t nBlock = 4096): m_nBlock(nBlock)
+  {
+    m_arrBlocks.emplace_back(new char[m_nBlock]);
+    m_pCur = m_pPending = m_arrBlocks[0].get();
+    m_pEnd = m_pCur + m_nBlock;
+  }
+
+  void write_static(const char *p, size_t n) override
+  {
+    if(n < MIN_REF)
+    {
+      write(p, n);
+    }
+    else
+    {
+      close_pending();
+      add(p, n);
+    }
+  }
+
+  // Returns the segments rendered so far
+  const vector<iovec> &iov()
+  {
+    close_pending();
+    return m_arrIov;
+  }
+
+  // Total bytes rendered
+  size_t size()
+  {
+    size_t n = 0;
+    for(const iovec &v: iov()) n += v.iov_len;
+    return n;
+  }
+
+  // Joins the segments, mostly for testing
+  string str()
+  {
+    string ret;
+    ret.reserve(size());
+    for(const iovec &v: m_arrIov) ret.append((const char *)v.iov_base, v.iov_len);
+    return ret;
+  }
+
+  // Writes everything to fd with as few writev calls as possible, returns false on error
+  bool writev(int fd)
+  {
+    close_pending();
+    iovec *pIov = m_arrIov.data();
+    size_t nIov = m_arrIov.size();
+
+    while(nIov)
+    {
+      ssize_t nDone = ::writev(fd, pIov, std::min(nIov, size_t(IOV_MAX)));
+      if(nDone < 0)
+      {
+        if(errno == EINTR) continue;
+        return false;
+      }
+
+      // Skip the segments written, and the written part of a partial one
+      while(nIov && size_t(nDone) >= pIov->iov_len)
+      {
+        nDone -= pIov->iov_len;
+        ++pIov;
+        --nIov;
+      }
+      if(nIov)
+      {
+        pIov->iov_base = (char *)pIov->iov_base + nDone;
+        pIov->iov_len -= nDone;
+      }
+    }
+
+    clear();
+    return true;
+  }
+
+  // Drops the output, keeping the scratch blocks for reuse and freeing the ones for large writes
+  void clear()
+  {
+    m_arrIov.clear();
+    m_arrLarge.clear();
+    m_iBlock = 0;
+    m_pCur = m_pPending = m_arrBlocks[0].get();
+    m_pEnd = m_pCur + m_nBlock;
+  }
+};
+
+} // namespace spt
+
+#endif
@@ -182,6 +182,16 @@ constexpr const char *g_arrTags[] =
 
 constexpr const char *g_arrCtrlTags[] = 
 {
+  // Kept sorted, it is binary searched
+  // The TAG_ constants in util.h follow this order
+  
+  // fragment cache <cache key='{{user}}' ttl=60>, both optional
+  // The rendered body is kept in an spt::fragment_cache under the key, or the values of the keys in the body
+  "cache",
+  
+  // streaming flush point <flush>, a void tag that renders nothing and flushes the sink
+  "flush",
+  
   // runtime loop <for var='n' from='1' to='10' inc='1'>
   // inc is optional, defaults to 1
   // Interval is half open like in a for loop 
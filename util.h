@@ -2,6 +2,8 @@
 #define SEEPHIT_UTIL_H
 
 #include "pch.h"
+#include "sink.h"
+#include "escape.h"
 
 namespace spt
 {
@@ -9,16 +11,32 @@ namespace spt
 const int NULL_NODE = -1;
 const int VOID_TAG = -2;
 
+// cnode::iTag is the index of the tag in g_arrTags, or one of these
+// Control tags are TAG_CTRL less their index in g_arrCtrlTags
+const int TAG_NONE = -1;    // Attribute names and unknown tags, only the spelling in the text is kept
+const int TAG_TEXT = -2;    // @text
+const int TAG_ATTR = -3;    // @attr
+const int TAG_CTRL = -4;
+const int TAG_CACHE = TAG_CTRL;
+const int TAG_FLUSH = TAG_CTRL - 1;
+const int TAG_FOR = TAG_CTRL - 2;
+const int TAG_IF = TAG_CTRL - 3;
+const int TAG_ROOT = TAG_CTRL - 4;
+
 // Template vals is a map of string to a template value
-using template_val = variant<int, string, float>;
+// Strings are escaped when rendered, raw_html is written as is
+using template_val = variant<int, string, float, raw_html>;
 using template_vals = unordered_map<string, template_val>;
 
-// Template funs is a map of string to a template render function
-// functions are written like @fn@param
-// when rendered function is passed the literal text of the param (this is useful for loops)
-// Function also get the template dictionary, which it can mutate for storing state
-using template_fun = function<void(ostream &, const string &sParam, template_vals &)>;
-using template_funs = unordered_map<string, template_fun>;
+// Every distinct template key is given a dense slot id when the tree is built
+// slot_dict maps the key name to its slot
+using slot_dict = unordered_map<string, int>;
+
+// Returns the slot for a key, assigning the next free slot if the key is new
+inline int get_slot(slot_dict &dctSlots, const string &sKey)
+{
+  return dctSlots.emplace(sKey, int(dctSlots.size())).first->second;
+}
 
 // Basic constexpr functions for text processing
 constexpr char to_upper(char ch)
@@ -129,22 +147,22 @@ constexpr int find_arr(const char *const arr[], int nTags, const char *val)
 
 // Simple abstraction for consexpr friendly dynamic arrays
 // Supports a basic STL like interface
-template<typename T, int SIZE> 
+// Storage is a std::array of SIZE elements, which may be 0
+template<typename T, size_t SIZE> 
 class vec
 {
   size_t m_uSize = 0;
-  const size_t m_iCapacity = SIZE;
-  T m_Nodes[SIZE];
+  std::array<T, SIZE> m_Nodes;
 
 public:
   constexpr T& operator[](size_t i)             { return m_Nodes[i]; }
   constexpr const T& operator[](size_t i) const { return m_Nodes[i]; }
   
-  constexpr T* begin()                  { return m_Nodes; }
-  constexpr T* end()                    { return m_Nodes + m_uSize; }
+  constexpr T* begin()                  { return m_Nodes.data(); }
+  constexpr T* end()                    { return m_Nodes.data() + m_uSize; }
                                         
-  constexpr const T* begin() const      { return m_Nodes; }
-  constexpr const T* end() const        { return m_Nodes + m_uSize; }
+  constexpr const T* begin() const      { return m_Nodes.data(); }
+  constexpr const T* end() const        { return m_Nodes.data() + m_uSize; }
                                         
   constexpr T& back()                   { return m_Nodes[m_uSize - 1]; }
   constexpr size_t size() const         { return m_uSize; }
@@ -268,99 +286,896 @@ inline ostream& operator<<(ostream &ostr, const char_view &sym)
   return ostr;
 }
 
-// Abstracts templatable text
-// A Sequence of char_view, pointing to eitehr plain text or template keys
+// Sink helper for above
+inline sink& operator<<(sink &out, const char_view &sym)
+{
+  out.write(sym.m_pBeg, sym.size());
+  return out;
+}
 
-class template_text
+// Index of sym in the sorted lowercase array arr, matched whole and without regard to case, -1 if absent
+// Unlike find_arr an entry that is only a prefix of sym does not match
+constexpr int find_sym(const char *const arr[], int nTags, const char_view &sym)
 {
-  // A sequence of char ranges, bool indicates if its a template
-  // The ranges exclude the {{ and }} parts for template strings
-  std::vector<pair<char_view, bool>> m_arrParts;
+  int left = 0;
+  int right = nTags;
+  
+  while(left < right)
+  {
+    int mid = (left + right) / 2;
+    const char *p = sym.begin(), *q = arr[mid];
+    char ch = 0;
+    while(p != sym.end() && (ch = to_lower(*p)) == *q)
+    {
+      ++p;
+      ++q;
+    }
+    
+    if(p == sym.end() && !*q) return mid;
+    
+    if(p != sym.end() && ch > *q)
+    {
+      left = mid + 1;
+    }
+    else
+    {
+      right = mid;
+    }
+  }
+  
+  return -1;
+}
+
+// Returns the first occurrence of the two char string psz in [pBeg, pEnd) or pEnd
+constexpr const char *find_pair(const char *pBeg, const char *pEnd, const char *psz)
+{
+  for(; pEnd - pBeg >= 2; ++pBeg)
+  {
+    if(pBeg[0] == psz[0] && pBeg[1] == psz[1]) return pBeg;
+  }
+  return pEnd;
+}
+
+// Block skips for runtime parses, where the parser knows the end of the text
+// They step 16 bytes at a time with SSE2 while no byte in the block matters, and leave the tail to the parser's own loop
+// Returns the first byte in [p, pEnd) that parse_text has to look at, < > { } or 0, or a position near pEnd
+inline const char *skip_plain(const char *p, const char *pEnd)
+{
+#if defined(__SSE2__)
+  const __m128i vLt = _mm_set1_epi8('<'), vGt = _mm_set1_epi8('>'), vZero = _mm_setzero_si128();
+  const __m128i vOpen = _mm_set1_epi8('{'), vClose = _mm_set1_epi8('}');
+  for(; pEnd - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i vHit = _mm_or_si128(_mm_cmpeq_epi8(v, vLt), _mm_or_si128(_mm_cmpeq_epi8(v, vGt), _mm_cmpeq_epi8(v, vZero)));
+    vHit = _mm_or_si128(vHit, _mm_or_si128(_mm_cmpeq_epi8(v, vOpen), _mm_cmpeq_epi8(v, vClose)));
+    
+    unsigned mask = _mm_movemask_epi8(vHit);
+    if(mask) return p + __builtin_ctz(mask);
+  }
+#endif
+  (void)pEnd;
+  return p;
+}
+
+// Returns the first byte in [p, pEnd) that is not whitespace, which the parser takes as any byte up to 32 but 0, or a position near pEnd
+inline const char *skip_space(const char *p, const char *pEnd)
+{
+#if defined(__SSE2__)
+  const __m128i vSpace = _mm_set1_epi8(32), vZero = _mm_setzero_si128();
+  for(; pEnd - p >= 16; p += 16)
+  {
+    // Compare with the signedness of char, where it is signed bytes from 128 up count as whitespace in the parser's loop
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+#if CHAR_MIN < 0
+    __m128i vAbove = _mm_cmpgt_epi8(v, vSpace);
+#else
+    __m128i vAbove = _mm_xor_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, vSpace), v), _mm_set1_epi8(-1));
+#endif
+    __m128i vHit = _mm_or_si128(vAbove, _mm_cmpeq_epi8(v, vZero));
+    
+    unsigned mask = _mm_movemask_epi8(vHit);
+    if(mask) return p + __builtin_ctz(mask);
+  }
+#endif
+  (void)pEnd;
+  return p;
+}
+
+// FNV-1a, for the template and value hashes an ETag is made of
+constexpr uint64_t FNV_OFFSET = 14695981039346656037ULL;
+constexpr uint64_t FNV_PRIME = 1099511628211ULL;
+
+constexpr uint64_t hash_bytes(const char *p, size_t n, uint64_t uHash = FNV_OFFSET)
+{
+  for(size_t i = 0; i < n; ++i)
+  {
+    uHash = (uHash ^ uint8_t(p[i])) * FNV_PRIME;
+  }
+  return uHash;
+}
+
+// Line number of a position in a text
+constexpr int text_row(const char *pszStart, const char *pos)
+{
+  // Count the number of newlines
+  int n = 0;
+  for(auto p = pszStart; p != pos; ++p)
+  {
+    if(*p == '\n') ++n;
+  }
+  return n + 1;
+}
+
+// Column number of a position in a text
+constexpr int text_col(const char *pszStart, const char *pos)
+{
+  // Count the number of chars to reach \n or beginning
+  int n = 0;
+  for(auto p = pos; p != pszStart && *p-- != '\n'; ++n);
+  return n;
+}
+
+// Splits text into plain chunks and {{key}} parts, calling fnPart(sym, bIsTemplate) for each
+// Template parts exclude the braces, empty {{}} parts are dropped
+template<typename F> constexpr void split_text(const char_view &text, F fnPart)
+{
+  auto itCurr = text.begin();
+  while(itCurr != text.end())
+  {
+    // Find a "{{", the part from itCurr to it is a non template chunk
+    auto itStart = find_pair(itCurr, text.end(), "{{");
+    if(itCurr != itStart)
+    {
+      fnPart(char_view(itCurr, itStart), false);
+    }
+    
+    if(itStart == text.end()) break;
+    
+    // find the closing }}, if not found the rest of the text is dropped
+    auto itEnd = find_pair(itStart, text.end(), "}}");
+    if(itEnd == text.end()) break;
+    
+    // Check if non empty tag
+    if((itEnd - itStart) > 2)
+    {
+      fnPart(char_view(itStart + 2, itEnd), true);
+    }
+    
+    // Set the current pointer beyond the template }}
+    itCurr = itEnd + 2;
+  }
+}
+
+// Splits a function call part of the form $fn@param into the name and the param, which may be empty
+constexpr void split_fun(const char_view &sym, char_view &symName, char_view &symParam)
+{
+  auto it = sym.begin() + 1;
+  while(it != sym.end() && *it != '@') ++it;
+  
+  symName = char_view(sym.begin() + 1, it);
+  symParam = it != sym.end() ? char_view(it + 1, sym.end()) : char_view();
+}
+
+// Splits a key part of the form key:spec into the key name and its numeric format
+// The spec is an optional .precision followed by an optional f, e or g
+// If what follows the last : is not a valid spec, like in {{Note:}}, the whole part is the key name
+constexpr void split_key(const char_view &sym, char_view &symName, value_format &fmt)
+{
+  symName = sym;
+  fmt = value_format();
+  
+  auto it = sym.end();
+  while(it != sym.begin() && *(it - 1) != ':') --it;
+  if(it == sym.begin() || it == sym.end()) return;
+  
+  value_format fmtSpec;
+  auto itSpec = it;
+  if(*itSpec == '.')
+  {
+    fmtSpec.nPrec = 0;
+    for(++itSpec; itSpec != sym.end() && *itSpec >= '0' && *itSpec <= '9'; ++itSpec)
+    {
+      fmtSpec.nPrec = fmtSpec.nPrec * 10 + (*itSpec - '0');
+      if(fmtSpec.nPrec > value_format::MAX_PREC) fmtSpec.nPrec = value_format::MAX_PREC;
+    }
+  }
+  if(itSpec != sym.end() && (*itSpec == 'f' || *itSpec == 'e' || *itSpec == 'g'))
+  {
+    fmtSpec.cType = *itSpec++;
+  }
+  
+  if(itSpec == sym.end() && fmtSpec.is_num())
+  {
+    symName = char_view(sym.begin(), it - 1);
+    fmt = fmtSpec;
+  }
+}
+
+// Key names in slot order and the slot ids sorted by name, built at compile time by a folded template
+// Names are looked up with a binary search, so a table for it needs no slot_dict
+struct key_index
+{
+  const char_view *pKeys = nullptr;
+  const int *pSorted = nullptr;
+  size_t nKeys = 0;
+  
+  // Returns the slot id of a key or NULL_NODE
+  constexpr int find(const char_view &sym) const
+  {
+    size_t iLo = 0, iHi = nKeys;
+    while(iLo < iHi)
+    {
+      size_t iMid = (iLo + iHi) / 2;
+      int iCmp = pKeys[pSorted[iMid]].cmpCase(sym);
+      if(iCmp == 0) return pSorted[iMid];
+      if(iCmp < 0)
+      {
+        iLo = iMid + 1;
+      }
+      else
+      {
+        iHi = iMid;
+      }
+    }
+    return NULL_NODE;
+  }
+};
+
+// Flat table of template values indexed by slot id
+// Values can also be set by key name, names unknown to the tree go into an overflow map
+// The table refers to the slot_dict or key_index of the tree that created it, so it must not outlive the tree
+class template_slots
+{
+  // A slot set in an overlay, see overlay()
+  struct local_val
+  {
+    int iSlot;
+    bool bBound;
+    template_val val;
+  };
+  
+  const slot_dict *m_pDctSlots = nullptr;
+  key_index m_keys;
+  vector<template_val> m_arrVals;
+  vector<bool> m_arrBound;
+  template_vals m_dctExtra;
+  
+  // For an overlay, the table read through to and the slots set over it
+  // A list keeps the values in place as slots are added, it only holds loop variables and what functions store
+  const template_slots *m_pBase = nullptr;
+  std::list<local_val> m_lstLocal;
+  
+  const local_val *local(int iSlot) const
+  {
+    for(const local_val &l: m_lstLocal)
+    {
+      if(l.iSlot == iSlot) return &l;
+    }
+    return nullptr;
+  }
+  
+  local_val *local(int iSlot)
+  {
+    return const_cast<local_val *>(static_cast<const template_slots *>(this)->local(iSlot));
+  }
+  
+  // The overlay's own value of a slot, a value of the base is copied the first time it is accessed
+  local_val &local_entry(int iSlot)
+  {
+    if(local_val *p = local(iSlot)) return *p;
+    
+    m_lstLocal.push_front(local_val{iSlot, false, m_pBase->bound(iSlot) ? m_pBase->at(iSlot) : template_val()});
+    return m_lstLocal.front();
+  }
   
 public:
+  template_slots() = default;
+  explicit template_slots(const slot_dict &dctSlots): 
+    m_pDctSlots(&dctSlots), m_arrVals(dctSlots.size()), m_arrBound(dctSlots.size()) {}
+  explicit template_slots(const key_index &keys): 
+    m_keys(keys), m_arrVals(keys.nKeys), m_arrBound(keys.nKeys) {}
   
-  void add(const char_view &sym, bool bIsTemplate)
+  // A table for one render over base, which is read and never written to, and must outlive it
+  // Loop variables and values functions set are kept in the overlay, so nothing is copied up front
+  static template_slots overlay(const template_slots &base)
   {
-    m_arrParts.push_back(std::make_pair(sym, bIsTemplate));
+    template_slots ret;
+    ret.m_pDctSlots = base.m_pDctSlots;
+    ret.m_keys = base.m_keys;
+    ret.m_pBase = &base;
+    return ret;
   }
   
-  // Checks if a map has the given key, and throws if not 
-  template<class T> void checkTemplateKey(const T& dct, const string &sKey)
+  // Returns the slot id of a key or NULL_NODE if the tree does not use it
+  int slot(const string &sKey) const
   {
-    auto i = dct.find(sKey);
-    if(i == dct.end())
+    if(m_pDctSlots)
     {
-      cerr << endl << "Template key undefined: '" << sKey << "'" << endl;
-      throw false;
+      auto it = m_pDctSlots->find(sKey);
+      if(it != m_pDctSlots->end()) return it->second;
+      return NULL_NODE;
+    }
+    return m_keys.find(char_view(sKey.data(), sKey.data() + sKey.size()));
+  }
+  
+  // Access by slot, marks the slot as bound just like map insertion would
+  template_val &operator[](int iSlot) 
+  { 
+    if(m_pBase)
+    {
+      local_val &l = local_entry(iSlot);
+      l.bBound = true;
+      return l.val;
     }
+    
+    m_arrBound[iSlot] = true; 
+    return m_arrVals[iSlot]; 
   }
   
-  // renders val if its of type T
-  template<typename T> bool render_value_if_type(ostream &ostr, const template_val &val) const
+  // Access by name, for convenience when filling in values
+  template_val &operator[](const string &sKey)
   {
-    if(std::holds_alternative<T>(val))
+    int iSlot = slot(sKey);
+    if(iSlot != NULL_NODE) return (*this)[iSlot];
+    
+    if(m_pBase && !m_dctExtra.count(sKey))
     {
-      ostr << std::get<T>(val);
-      return true;
+      auto it = m_pBase->m_dctExtra.find(sKey);
+      if(it != m_pBase->m_dctExtra.end()) return m_dctExtra[sKey] = it->second;
     }
-    return false;
+    return m_dctExtra[sKey];
+  }
+  
+  // Sets an int in place, the variant is only reassigned if it holds another type
+  void set_int(int iSlot, int i)
+  {
+    template_val *pVal;
+    if(m_pBase)
+    {
+      local_val *p = local(iSlot);
+      if(!p)
+      {
+        m_lstLocal.push_front(local_val{iSlot, true, i});
+        return;
+      }
+      p->bBound = true;
+      pVal = &p->val;
+    }
+    else
+    {
+      m_arrBound[iSlot] = true;
+      pVal = &m_arrVals[iSlot];
+    }
+    
+    if(int *p = std::get_if<int>(pVal))
+    {
+      *p = i;
+    }
+    else
+    {
+      *pVal = i;
+    }
+  }
+  
+  const template_val &at(int iSlot) const
+  {
+    if(!m_pBase) return m_arrVals[iSlot];
+    const local_val *p = local(iSlot);
+    return p ? p->val : m_pBase->at(iSlot);
+  }
+  
+  bool bound(int iSlot) const
+  {
+    if(!m_pBase) return m_arrBound[iSlot];
+    const local_val *p = local(iSlot);
+    return p ? p->bBound : m_pBase->bound(iSlot);
+  }
+  
+  void unbind(int iSlot)
+  {
+    if(!m_pBase)
+    {
+      m_arrBound[iSlot] = false;
+      return;
+    }
+    
+    if(local_val *p = local(iSlot))
+    {
+      p->bBound = false;
+    }
+    else
+    {
+      m_lstLocal.push_front(local_val{iSlot, false, {}});
+    }
+  }
+  
+  size_t size() const { return m_pBase ? m_pBase->size() : m_arrVals.size(); }
+};
+
+// Whether render can run on T directly, other values go to the overloads that build a table from them
+template<typename T> struct is_slot_table: std::false_type {};
+template<> struct is_slot_table<template_slots>: std::true_type {};
+
+// Folds the values of a table into a hash in slot order, unbound slots included
+// Each value is preceded by its type and strings by their length, so neighbouring values cannot run together
+inline uint64_t hash_slots(const template_slots &slots, uint64_t uHash)
+{
+  auto fnBytes = [&](const void *p, size_t n) { uHash = hash_bytes(static_cast<const char *>(p), n, uHash); };
+  auto fnString = [&](const string &s)
+  {
+    size_t n = s.size();
+    fnBytes(&n, sizeof(n));
+    fnBytes(s.data(), n);
+  };
+  
+  for(size_t i = 0; i < slots.size(); ++i)
+  {
+    char chKind = slots.bound(i) ? char('0' + slots.at(i).index()) : '-';
+    fnBytes(&chKind, 1);
+    if(!slots.bound(i)) continue;
+    
+    const template_val &val = slots.at(i);
+    if(auto pInt = std::get_if<int>(&val))            fnBytes(pInt, sizeof(*pInt));
+    else if(auto pFloat = std::get_if<float>(&val))   fnBytes(pFloat, sizeof(*pFloat));
+    else if(auto pStr = std::get_if<string>(&val))    fnString(*pStr);
+    else if(auto pRaw = std::get_if<raw_html>(&val))  fnString(pRaw->html);
+  }
+  return uHash;
+}
+
+// Formats a hash as a strong ETag, 16 hex digits in quotes
+inline string format_etag(uint64_t uHash)
+{
+  char szTag[] = "\"0000000000000000\"";
+  for(int i = 16; i > 0; --i, uHash >>= 4)
+  {
+    szTag[i] = "0123456789abcdef"[uHash & 15];
+  }
+  return szTag;
+}
+
+// Writes a value, numbers use the format spec if there is one
+template<typename T> void write_value(sink &out, const T &val, const value_format &fmt, std::true_type /*arithmetic*/)
+{
+  if(!fmt.is_num())
+  {
+    out << val;
+  }
+  else
+  {
+    out.write_num(double(val), fmt);
+  }
+}
+
+template<typename T> void write_value(sink &out, const T &val, const value_format & /*unused*/, std::false_type /*arithmetic*/)
+{
+  out << val;
+}
+
+template<typename T> void write_value(sink &out, const T &val, const value_format &fmt)
+{
+  write_value(out, val, fmt, std::is_arithmetic<T>{});
+}
+
+// Strings are escaped for the context the key is in
+inline void write_value(sink &out, const string &val, const value_format &fmt)
+{
+  write_escaped(out, val.data(), val.size(), fmt.ctx);
+}
+
+inline void write_value(sink &out, const raw_html &val, const value_format & /*unused*/)
+{
+  out << val.html;
+}
+
+// renders val if its of type T
+template<typename T> bool render_value_if_type(sink &out, const template_val &val, const value_format &fmt)
+{
+  if(std::holds_alternative<T>(val))
+  {
+    write_value(out, std::get<T>(val), fmt);
+    return true;
   }
+  return false;
+}
 
-  // Renders this node
-  void render(ostream &ostr, template_vals& dctVals, template_funs& dctFuns)
+// Renders the value in a slot, throws if the key was never given a value
+inline void render_slot(sink &out, const template_slots &slots, int iSlot, const char_view &symKey, const value_format &fmt)
+{
+  if(!slots.bound(iSlot))
   {
+    cerr << endl << "Template key undefined: '" << symKey << "'" << endl;
+    throw false;
+  }
+  
+  const template_val &val = slots.at(iSlot);
+  render_value_if_type<int>(out, val, fmt)    ||
+  render_value_if_type<string>(out, val, fmt) ||
+  render_value_if_type<float>(out, val, fmt)  ||
+  render_value_if_type<raw_html>(out, val, fmt);
+}
+
+// Returns the table that holds loop variables and is passed to template functions
+inline template_slots &loop_slots(template_slots &slots)
+{
+  return slots;
+}
+
+// Integer parameters of a for tag, parsed once from the template
+struct loop_params
+{
+  int iFrom = 0;
+  int iTo = 0;
+  int iInc = 1;
+  
+  // Number of iterations
+  constexpr int count() const
+  {
+    int n = iInc > 0 ? (iTo - iFrom + iInc - 1) / iInc : (iFrom - iTo - iInc - 1) / -iInc;
+    return n > 0 ? n : 0;
+  }
+};
+
+// Scope of a loop variable, the previous value of the slot is restored when it ends
+class loop_var
+{
+  template_slots &m_slots;
+  int m_iSlot;
+  bool m_bUsed;
+  template_val m_varSaved;
+  
+public:
+  loop_var(template_slots &slots, int iSlot): m_slots(slots), m_iSlot(iSlot), m_bUsed(slots.bound(iSlot))
+  {
+    if(m_bUsed) m_varSaved = slots.at(iSlot);
+  }
+  
+  loop_var(const loop_var &) = delete;
+  loop_var &operator=(const loop_var &) = delete;
+  
+  // Restore the loop var in the template values or unbind it if it wasnt bound before
+  ~loop_var()
+  {
+    if(m_bUsed)
+    {
+      m_slots[m_iSlot] = std::move(m_varSaved);
+    }
+    else
+    {
+      m_slots.unbind(m_iSlot);
+    }
+  }
+  
+  void set(int i)
+  {
+    m_slots.set_int(m_iSlot, i);
+  }
+};
+
+// Runs fnBody for each value of a loop variable in [iFrom, iTo) stepping by iInc
+// Any previous value of the variable is restored afterwards, which allows nested loops with the same var
+// The variable is updated in place, an iteration does no hashing or allocation
+template<typename F> void run_loop(template_slots &slots, int iSlot, const loop_params &loop, F fnBody)
+{
+  loop_var var(slots, iSlot);
+  for(int i = loop.iFrom; loop.iInc > 0 ? i < loop.iTo : i > loop.iTo; i += loop.iInc)
+  {
+    var.set(i);
+    fnBody();
+  }
+}
+
+// Argument of a template function call, functions are written like {{$fn@param}}
+// The param is split and looked up when the template is built, so a call does no parsing or hashing
+struct fun_arg
+{
+  // Literal text of the param (this is useful for loops)
+  std::string_view param;
+  
+  // Slot of the param, a param that names no key has a slot of its own, NULL_NODE if the call has no param
+  int iSlot = NULL_NODE;
+  
+  // Returns the value of the key named by the param, which is an indexed read for a call built by a template
+  // Only an arg built without a slot is looked up by name
+  template_val &value(template_slots &vals) const
+  {
+    return iSlot != NULL_NODE ? vals[iSlot] : vals[string(param)];
+  }
+};
+
+// Template functions get the sink, the argument and the template values, which they can mutate for storing state
+using fun_ptr = void (*)(sink &, const fun_arg &, template_slots &);
+using template_fun = function<void(sink &, const fun_arg &, template_slots &)>;
+
+// A registered template function
+// Callables without state, like plain functions and lambdas with no captures, are kept as a function pointer
+// Only callables with state go through std::function
+class fun_entry
+{
+  fun_ptr m_pfn = nullptr;
+  template_fun m_fn;
+  size_t m_nMaxSize = 0;
+  
+  template<typename F> void assign(F &&fn, std::true_type)
+  {
+    m_pfn = fn;
+    m_fn = nullptr;
+  }
+  
+  template<typename F> void assign(F &&fn, std::false_type)
+  {
+    m_pfn = nullptr;
+    m_fn = std::forward<F>(fn);
+  }
+  
+public:
+  template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, fun_entry>::value>::type> 
+  fun_entry &operator=(F &&fn)
+  {
+    assign(std::forward<F>(fn), std::is_convertible<F, fun_ptr>{});
+    return *this;
+  }
+  
+  // Most bytes one call writes, for tree::estimate_size, 0 if not known and SPT_FUN_SIZE is counted instead
+  fun_entry &max_size(size_t n)
+  {
+    m_nMaxSize = n;
+    return *this;
+  }
+  
+  size_t max_size() const { return m_nMaxSize; }
+  
+  void operator()(sink &out, const fun_arg &arg, template_slots &vals) const
+  {
+    if(m_pfn)
+    {
+      m_pfn(out, arg, vals);
+    }
+    else
+    {
+      m_fn(out, arg, vals);
+    }
+  }
+};
+
+// A function name and pointer, a constexpr array of these can be used to fill template_funs
+// nMaxSize is the most bytes one call writes, see fun_entry::max_size
+struct fun_def
+{
+  const char *pszName;
+  fun_ptr pfn;
+  size_t nMaxSize = 0;
+};
+
+// Template functions by name
+class template_funs
+{
+  unordered_map<string, fun_entry> m_dctFuns;
+  
+public:
+  template_funs() = default;
+  
+  template<size_t N> explicit template_funs(const fun_def (&arrDefs)[N])
+  {
+    for(const auto &def: arrDefs)
+    {
+      m_dctFuns[def.pszName] = def.pfn;
+      m_dctFuns[def.pszName].max_size(def.nMaxSize);
+    }
+  }
+  
+  fun_entry &operator[](const string &sName)
+  {
+    return m_dctFuns[sName];
+  }
+  
+  // Returns the function or nullptr
+  const fun_entry *find(const string &sName) const
+  {
+    auto it = m_dctFuns.find(sName);
+    return it != m_dctFuns.end() ? &it->second : nullptr;
+  }
+};
+
+// The functions of a template_funs looked up for one template, indexed by the ids the template gave them
+// Lookups by name happen once here instead of on every call
+class bound_funs
+{
+  vector<const fun_entry *> m_arrFuns;
+  vector<string> m_arrNames;
+  
+public:
+  bound_funs() = default;
+  
+  // [itBeg, itEnd) are the function names of the template in id order
+  template<typename IT> bound_funs(const template_funs &funs, IT itBeg, IT itEnd)
+  {
+    for(; itBeg != itEnd; ++itBeg)
+    {
+      string sName(itBeg->begin(), itBeg->end());
+      m_arrFuns.push_back(funs.find(sName));
+      m_arrNames.push_back(std::move(sName));
+    }
+  }
+  
+  // Calls a function, throws if it was not defined
+  void call(int iFun, sink &out, const fun_arg &arg, template_slots &vals) const
+  {
+    const fun_entry *pFun = m_arrFuns[iFun];
+    if(!pFun)
+    {
+      cerr << endl << "Template key undefined: '" << m_arrNames[iFun] << "'" << endl;
+      throw false;
+    }
+    (*pFun)(out, arg, vals);
+  }
+};
+
+// Abstracts templatable text
+// Holds the text parts of every node of a tree in one table, a node refers to a range [iBeg, iEnd) of it
+// Parts are plain text or template keys, keys are resolved to their slot and functions to their id when added, so rendering does no lookups
+// Plain text is copied into a single buffer owned by the table and referred to by offset, so a copy of the table stays valid
+
+class template_text
+{
+public:
+  struct part
+  {
+    // The key or function call, the range excludes the {{ and }} parts
+    char_view sym;
+    bool bTemplate;
+    
+    // Plain text, [iOffset, iOffset + nLen) of the text buffer
+    int iOffset;
+    int nLen;
+    
+    // Slot and format spec of the key, NULL_NODE for plain text and function calls
+    int iSlot;
+    value_format fmt;
+    
+    // Function id and argument for function calls, see bound_funs
+    int iFun;
+    fun_arg arg;
+  };
+  
+private:
+  std::vector<part> m_arrParts;
+  string m_sText;
+  
+  // First part of the range being added, plain text is only merged with a previous part in the same range
+  int m_iRange = 0;
+  
+public:
+  
+  // Starts a new range, returns its first index
+  int begin_range()
+  {
+    m_iRange = m_arrParts.size();
+    return m_iRange;
+  }
+  
+  // One past the last part added
+  int size() const { return m_arrParts.size(); }
+  
+  // Copies plain text into the text buffer without adding a part, returns its offset
+  int add_text(const char *p, size_t n)
+  {
+    int iOffset = m_sText.size();
+    m_sText.append(p, n);
+    return iOffset;
+  }
+  
+  // Adds a part, function names are given ids in the order they are first seen
+  // ctx is where the text is in the markup, keys are escaped for it
+  void add(const char_view &sym, bool bIsTemplate, slot_dict &dctSlots, vector<string> &arrFunNames, html_ctx ctx = HC_TEXT)
+  {
+    if(!bIsTemplate)
+    {
+      // Extend the previous plain text of this range if possible, it always ends the buffer
+      if(size() > m_iRange && !m_arrParts.back().bTemplate)
+      {
+        add_text(sym.begin(), sym.size());
+        m_arrParts.back().nLen += sym.size();
+      }
+      else
+      {
+        int iOffset = add_text(sym.begin(), sym.size());
+        m_arrParts.push_back(part{{}, false, iOffset, int(sym.size()), NULL_NODE, {}, NULL_NODE, {}});
+      }
+      return;
+    }
+    
+    part part{sym, true, 0, 0, NULL_NODE, {}, NULL_NODE, {}};
+    if(sym.front() != '$')
+    {
+      split_key(sym, part.sym, part.fmt);
+      part.fmt.ctx = ctx;
+      part.iSlot = get_slot(dctSlots, string(part.sym.begin(), part.sym.end()));
+    }
+    else
+    {
+      char_view symName, symParam;
+      split_fun(sym, symName, symParam);
+      
+      string sName(symName.begin(), symName.end());
+      auto it = std::find(arrFunNames.begin(), arrFunNames.end(), sName);
+      part.iFun = it - arrFunNames.begin();
+      if(it == arrFunNames.end()) arrFunNames.push_back(sName);
+      
+      // The param gets a slot where it is first seen, the same as template_keys gives it
+      part.arg.param = std::string_view(symParam.begin(), symParam.size());
+      if(!symParam.empty()) part.arg.iSlot = get_slot(dctSlots, string(symParam.begin(), symParam.end()));
+    }
+    m_arrParts.push_back(part);
+  }
+  
+  // Renders the parts [iBeg, iEnd)
+  // VALS is the value table, keys are rendered with render_slot(out, vals, ...)
+  template<typename VALS> void render(sink &out, VALS &vals, const bound_funs &funs, int iBeg, int iEnd) const
+  {
+    const part *pParts = m_arrParts.data();
+    const char *pText = m_sText.data();
+    
     // Render each part
-    for(const auto &part: m_arrParts)
+    for(int i = iBeg; i < iEnd; ++i)
     {
+      const part &part = pParts[i];
+      
       // If its a template, render the template value
-      if(part.second)
+      if(part.bTemplate)
       {
-        // Get key and ensure it is in the map, then render the value
-        string sKey(part.first.begin(), part.first.end());
-        
-        // Keys starting with $ are functions + 1)
-        if(sKey[0] == '$')
+        // Regular template value, the slot was resolved at build time
+        if(part.iSlot != NULL_NODE)
         {
-          // function is of the form $fn@param, check if @ is present
-          auto it = find(begin(sKey), end(sKey), '@');
-          
-          // Get the function name and check if its defined
-          string sFnName{begin(sKey) + 1, it};
-          checkTemplateKey(dctFuns, sFnName);
-          
-          // If there is an @param, extract the param
-          string sParam;
-          if(it != end(sKey) && ++it != end(sKey))
-          {
-            sParam = string(it, end(sKey));
-          }
-          
-          // Invoke the function -> void(ostream &, const string &, template_vals &)>)
-          // Function may mutate the dictionary
-          dctFuns[sFnName](ostr, sParam, dctVals);
+          render_slot(out, vals, part.iSlot, part.sym, part.fmt);
         }
-        else // regular template value
+        else // Keys starting with $ are functions
         {
-          checkTemplateKey(dctVals, sKey);
-          render_value_if_type<int>(ostr, dctVals[sKey])    ||
-          render_value_if_type<string>(ostr, dctVals[sKey]) ||
-          render_value_if_type<float>(ostr, dctVals[sKey]);
+          funs.call(part.iFun, out, part.arg, loop_slots(vals));
         }
       }
-      else // Non template text, render it
+      else // Non template text, points into the text buffer
       {
-        ostr << part.first;
+        out.write_static(pText + part.iOffset, part.nLen);
       }
     }
   }
   
-  std::vector<pair<char_view, bool>> parts() const { return m_arrParts; }
+  // Bytes of plain text in the parts [iBeg, iEnd)
+  size_t text_size(int iBeg, int iEnd) const
+  {
+    size_t n = 0;
+    for(int i = iBeg; i < iEnd; ++i)
+    {
+      if(!m_arrParts[i].bTemplate) n += m_arrParts[i].nLen;
+    }
+    return n;
+  }
+  
+  // Whether any of the parts [iBeg, iEnd) is a key or a function call
+  bool has_template(int iBeg, int iEnd) const
+  {
+    for(int i = iBeg; i < iEnd; ++i)
+    {
+      if(m_arrParts[i].bTemplate) return true;
+    }
+    return false;
+  }
+  
+  // Writes [iOffset, iOffset + nLen) of the text buffer
+  void write_text(sink &out, int iOffset, int nLen) const
+  {
+    out.write_static(m_sText.data() + iOffset, nLen);
+  }
+  
+  const std::vector<part> &parts() const { return m_arrParts; }
 };
 
 // Simple abstraction for a symbol table
-struct sym_tab
+template<size_t SIZE> struct sym_tab
 {
-  vec<char_view, 1024> m_arrSyms;
+  vec<char_view, SIZE> m_arrSyms;
   
   // Adds a symbol to the table, returns false if already exists
   constexpr bool addSym(const char_view &symNew)
@@ -394,7 +1209,8 @@ struct cnode
    * and 
    * child |
    * 
-   * Two symbols, tag and text represent the tagname and the text content if any
+   * The tag and text represent the tagname and the text content if any, an attribute's name and value
+   * Known tags also keep their index in g_arrTags, so tags are compared as integers
    * 
    * For example
    * <HTML>
@@ -426,48 +1242,19 @@ struct cnode
   
   constexpr cnode() = default;
     
-  constexpr cnode(const char_view &tag):
-    sibling(NULL_NODE), child(NULL_NODE), tag(tag){}
-
-  constexpr cnode(const char_view &tag, const char_view &text):
-    sibling(NULL_NODE), child(NULL_NODE), tag(tag), text(text){}
-    
-    
-  void dump() const
-  {
-    cerr << "id=" << id << ",";
-    cerr << "sibling=" << sibling << ",";
-    cerr << "child=" << child << ",";
-    cerr << "tag=" << tag << ",";
-    cerr << "text=" << text << endl;
-  }
-  
-  // returns the tag in lowercase
-  const string getTag() const 
-  {
-    string ret(tag.m_pBeg, tag.size());
-    transform(begin(ret), end(ret), begin(ret), to_lower);
-    return ret;
-  };
-  
-  // Returns the text content, optionally stripping leading and trailing space
-  const string getText(bool trim = false) const 
-  {
-    auto b = text.m_pBeg, e = text.m_pEnd;
-    if(trim && b != e)
-    {
-      while(is_space(*b)) b++;
-      while(e >= b && is_space(e[-1])) e--;
-    }
+  constexpr explicit cnode(int iTag): iTag(iTag) {}
     
-    return string(b, e);
-  };
-  
+  // The tag, text and ID are offsets and lengths in the template text rather than pointers, see basic_parser::tag()
+  // So a node is 32 bytes of integers rather than 56 with pointers, and can be written out as is
   int sibling = NULL_NODE;
   int child = NULL_NODE;
-  char_view tag;
-  char_view text;
-  char_view id;
+  uint32_t iName = 0;
+  uint16_t nName = 0;
+  int16_t iTag = TAG_NONE;
+  uint32_t iText = 0;
+  uint32_t nText = 0;
+  uint32_t iId = 0;
+  uint32_t nId = 0;
 };
 
 